@@ -7,57 +7,421 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
 
 #include "channel.h"
 #include "mimpi.h"
 #include "mimpi_common.h"
 #include <pthread.h>
 #include <semaphore.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #define DESC_SHIFT 30
+#define SHARED_DESC (DESC_SHIFT - 1)
+
+// Layout of a point-to-point frame:
+#define FRAME_SIZE 512
+#define FIRST_PAYLOAD_SIZE 487
+#define FRAME_CONTEXT_FIRST 487
+#define FRAME_CONTEXT_LAST 490
+#define FRAME_COUNT_FIRST 491
+#define FRAME_COUNT_LAST 500
+#define FRAME_TAG_FIRST 501
+#define FRAME_TAG_LAST 510
+#define FRAME_TYPE 511
+
+// Receiver threads read up to that many bytes (many frames) per syscall:
+#define READ_BATCH_SIZE (64 * FRAME_SIZE)
+
+// Layout of an entry of a coalesced frame (number of entries is kept in count field):
+#define COALESCE_COUNT_DIGITS 3
+#define COALESCE_CONTEXT_DIGITS 4
+#define COALESCE_TAG_DIGITS 10
+#define COALESCE_ENTRY_HEADER (COALESCE_COUNT_DIGITS + COALESCE_CONTEXT_DIGITS + COALESCE_TAG_DIGITS)
+
+// Tags inside the library carry the context of the communicator above the tag given by the user:
+#define CONTEXT_SHIFT 32
+#define CONTEXT_TAG(context, tag) (((long)(context) << CONTEXT_SHIFT) | (unsigned int)(tag))
+#define TAG_CONTEXT(tag) ((int)((tag) >> CONTEXT_SHIFT))
+#define USER_TAG(tag) ((int)((tag) & 0xFFFFFFFFL))
+#define ANY_TAG_OF(tag) CONTEXT_TAG(TAG_CONTEXT(tag), MIMPI_ANY_TAG)
+
+// Events passed from receiver threads to the main thread:
+#define CACHE_LINE_SIZE 64
+#define RING_SIZE 256
+#define EVENT_MESSAGE 0
+#define EVENT_FINAL 1
+#define EVENT_RTS 2         // request to send, data comes once the receive matches it
+#define EVENT_PAYLOAD 3     // data of a rendezvous message
+
+// Reasons of waking the main thread that waits for a process:
+#define WAKE_NONE 0
+#define WAKE_MESSAGE 1
+#define WAKE_FINAL 2
+#define WAKE_DEADLOCK 3
+#define WAKE_TIMEOUT 4
+
+// Layout of a deadlock probe frame (count and tag are at their usual places):
+#define PROBE_INITIATOR_FIRST 0
+#define PROBE_INITIATOR_LAST 9
+#define PROBE_EPOCH_FIRST 10
+#define PROBE_EPOCH_LAST 19
+#define PROBE_CONSUMED_FIRST 20
+#define PROBE_CONSUMED_LAST 29
+#define PROBE_CONFIRM 30
+
+#define COUNTER_BUCKETS 1024
+
+// Request to send carries its number here (count and tag are at their usual places):
+#define RENDEZVOUS_ID_FIRST 0
+#define RENDEZVOUS_ID_LAST 9
+
+// Header of a striped message on the main channel carries the type of its frames and its number here,
+// header of a part on another channel has the number and the count of the whole message:
+#define STRIPE_KIND 0
+#define STRIPE_ID_FIRST 1
+#define STRIPE_ID_LAST 10
+
+// Generation of the shared barrier has this bit set once some process has finished:
+#define SHARED_FINISHED (1 << 30)
+
+// Tag of collective messages in their own context:
+#define COLLECTIVE_TAG 1
+
+// Neighbor collectives, in the collective context: tag of the first one, then one per slot of a Cartesian neighbor:
+#define NEIGHBOR_TAG 2
+
+// Contexts that fit in the 4 digits of frames (collectives use context*2 + 1):
+#define CONTEXT_COUNT 5000
+
+// Affinity masks cover that many words of cores:
+#define CPU_MASK_WORDS 16
+
+// Handles of user operators come after the predefined ones:
+#define USER_OP_FIRST (MIMPI_PROD + 1)
+
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 // Structures:
 struct MessageParameters {
     int count;
-    int tag;
+    long tag;
 };
 
 struct WaitingMessageParameters {
+    int type;
     struct MessageParameters parameters;
+    int id;
     char* data;
     struct WaitingMessageParameters* next;
 };
 
-struct SentMessageParameters {
+struct Event {
+    int type;
+    struct MessageParameters parameters;
+    int id;
+    char* data;
+    struct Event* next;
+};
+
+// Single-producer (receiver thread) single-consumer (main thread) ring of events from one process.
+// When the ring is full, events go to the overflow list until the consumer takes it.
+struct EventRing {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;
+    _Alignas(CACHE_LINE_SIZE) atomic_int overflowCount;
+    pthread_mutex_t overflowMutex;
+    struct Event* overflowHead;
+    struct Event* overflowTail;
+    _Alignas(CACHE_LINE_SIZE) struct Event events[RING_SIZE];
+
+    // Receive that the main thread sleeps on, armed while waiter is odd (generation * 2 + 1):
+    _Alignas(CACHE_LINE_SIZE) atomic_uint waiter;
+    atomic_int waitCount;
+    atomic_long waitTag;
+    atomic_int wakeReason;
+    unsigned int waitGeneration;
+};
+
+// Receive posted by one of application threads (MIMPI_THREAD_MULTIPLE), completed by the receiver thread.
+struct PostedReceive {
     struct MessageParameters parameters;
-    struct SentMessageParameters* next;
+    int rendezvousId;   // request to send that the receive has matched (-1 if none)
+    void* data;
+    const struct Datatype* type;    // layout of data (NULL if contiguous)
+    int status;
+    pthread_cond_t cond;
+    struct PostedReceive* next;
+};
+
+struct CoalesceBuffer {
+    char frame[FRAME_SIZE];
+    int used;
+    int entries;
+    struct timespec firstEntry;
 };
 
-// Global pointer to an array of sent messages:
-struct SentMessageParameters** sentMessages = NULL;
+// Number of messages with given parameters sent to or received from a process:
+struct MessageCounter {
+    int peer;
+    struct MessageParameters parameters;
+    long value;
+    struct MessageCounter* next;
+};
 
 // Global pointer to an array of waiting messages:
 struct WaitingMessageParameters** waitingMessages = NULL;
 
-// Global pointer to an array of current deadlock:
-struct MessageParameters* currentDeadlock = NULL;
+// Message copied by MIMPI_Bsend (or MIMPI_Send with a send queue), waiting for the writer thread:
+struct QueuedSend {
+    char* data;
+    int count;
+    long tag;
+    int attached;   // space taken from the attached buffer, not from the send queue budget
+    struct Request* request;    // started persistent send (its data is not copied), NULL for a copy
+    struct QueuedSend* next;
+};
+
+struct SendQueue {
+    struct QueuedSend* head;
+    struct QueuedSend* tail;
+    int busy;       // the writer is sending a message taken from the queue
+    int started;
+    pthread_t writer;
+};
+
+// Send queues (created by MIMPI_Buffer_attach or with MIMPI_SEND_QUEUE_BYTES), all guarded by queueMutex:
+struct SendQueue* sendQueues = NULL;
+pthread_mutex_t queueMutex;
+pthread_cond_t queueCond;
+int queuesStopping = 0;
+int queueBudget = 0;            // bytes that MIMPI_Send may leave in queues (0 - it writes by itself)
+int queueUsed = 0;
+void* attachedBuffer = NULL;
+int attachedSize = 0;           // bytes that MIMPI_Bsend may leave in queues
+int attachedUsed = 0;
+
+// Beginning of the segment shared by all processes (created by mimpirun with MIMPI_SHM_BYTES):
+struct SharedControl {
+    _Alignas(CACHE_LINE_SIZE) atomic_int arrived;
+    _Alignas(CACHE_LINE_SIZE) atomic_int generation;
+};
+
+// Shared-memory collectives (off unless mimpirun has created the segment):
+struct SharedControl* sharedControl = NULL;
+uint8_t* sharedData = NULL;     // data area, right after the control structure
+size_t sharedSize = 0;          // size of the whole mapping
+int sharedBytes = 0;            // size of the data area used by collectives (windows take the rest)
+
+// One-sided window: memory of every process, allocated from the top of the shared segment:
+struct Window {
+    int* offsets;       // offset of the memory of each process in the segment (NULL if the handle is free)
+    int* sizes;
+    int locksOffset;    // lock and accumulate lock of each process, a cache line each
+    int bottom;         // lowest offset taken by the window
+};
+
+struct Window* windows = NULL;
+int windowCount = 0;
+
+// Group of processes with its own ranks, tags and collective tree (handle is the index in communicators):
+struct Communicator {
+    int size;
+    int rank;
+    int* worldRanks;    // world rank of every member (NULL if the handle is free)
+    int context;        // point-to-point messages go in context*2, collectives in context*2 + 1
+    int dimCount;       // Cartesian topology (dims is NULL for other communicators)
+    int* dims;
+    int* periods;
+    int neighborCount;  // neighbors in the order of neighbor collectives (NULL if there is no topology)
+    int* neighbors;
+};
+
+struct Communicator* communicators = NULL;
+int communicatorCount = 0;
+int pinned = 0;         // a topology with reorder has pinned the process to its core
+
+// Bytes of one element of a datatype at an offset from the start of the element:
+struct TypeBlock {
+    long offset;
+    int length;
+};
+
+// Layout of one element as blocks in the order they are packed (handle is the index in datatypes):
+struct Datatype {
+    struct TypeBlock* blocks;   // NULL if the handle is free
+    int blockCount;
+    int size;           // bytes packed from one element
+    long extent;        // distance between consecutive elements in memory
+    int committed;
+    long stride;        // blocks of equal length stride bytes apart (0 if they are not)
+};
+
+struct Datatype* datatypes = NULL;
+int datatypeCount = 0;
+
+// Reduction operator given by the user (handle is USER_OP_FIRST + the index in userOps):
+struct UserOp {
+    MIMPI_User_function* function;  // NULL if the handle is free
+    bool commute;
+};
+
+struct UserOp* userOps = NULL;
+int userOpCount = 0;
+
+// Persistent request of MIMPI_Send_init or MIMPI_Recv_init (handle is the index in requests):
+struct Request {
+    int receive;
+    void* data;
+    int count;
+    int peer;
+    long tag;
+    int active;                     // started and not waited for yet
+    int pending;                    // the started send waits for the payload writer (under clearanceMutex)
+    int received;                   // the started receive was done before its wait
+    int rendezvousId;               // of the request to send of a pending send
+    MIMPI_Retcode result;           // of the started send or of the early receive
+    struct Request* nextPending;
+    char header[FRAME_SIZE];        // first frame of the send, without payload
+    struct PostedReceive posted;    // receive on the list of the source (MIMPI_THREAD_MULTIPLE)
+};
+
+struct Request** requests = NULL;   // NULL if the handle is free (requests do not move, their receives are linked)
+int requestCount = 0;
+
+// Striped message from a process that is being collected (its first part comes on the main channel):
+struct Assembly {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int id;             // number of the message (0 if none)
+    char* message;
+    int partsLeft;      // parts of other channels that are not read yet
+    int writers;        // readers of other channels that are reading a part into message right now
+    int lowestEnded;    // last message with a part from a channel that has ended (INT_MAX if none has)
+    int mainEnded;      // main channel has ended, no more messages will come
+};
 
-// Global pointer to an array of current receiver:
-struct MessageParameters* currentReceiver = NULL;
+// Striping of large messages (off unless mimpirun has opened more channels with MIMPI_STRIPES):
+int stripes = 1;                        // channels to every process, the main one included
+int stripeBytes = 0;                    // smallest message that is striped
+int* stripeReadDesc = NULL;             // channel i (1 .. stripes-1) of process t at t*stripes + i
+int* stripeWriteDesc = NULL;
+pthread_t* stripeThreads = NULL;
+int* stripeIds = NULL;                  // last striped message to a process (under its sending lock)
+struct Assembly* assemblies = NULL;
+
+// Request to send that the receiver has matched:
+struct Clearance {
+    int id;
+    struct Clearance* next;
+};
 
-// Global pointer to an array of semaphores:
-sem_t* arrayOfSemaphores = NULL;
+// Flow control (off unless MIMPI_EAGER_BYTES or MIMPI_UNEXPECTED_BYTES is set):
+int eagerCredit = 0;                    // bytes that may be sent to a process before its receives catch up
+atomic_long* sendCredits = NULL;        // bytes that may still be sent eagerly to a process
+long* returnedCredits = NULL;           // bytes received from a process that were not returned yet
+int* rendezvousIds = NULL;              // last request to send to a process
+struct Clearance** clearances = NULL;   // requests to send matched by a process
+pthread_mutex_t clearanceMutex;
+pthread_cond_t clearanceCond;
+
+// Started sends whose data goes when the destination clears them (below MIMPI_THREAD_MULTIPLE), guarded by clearanceMutex:
+struct Request* pendingPayloads = NULL;
+int payloadWriterStarted = 0;
+int payloadsStopping = 0;
+pthread_t payloadWriter;
+
+// Global pointer to an array of posted receives (only with MIMPI_THREAD_MULTIPLE):
+struct PostedReceive** postedReceives = NULL;
+
+// Global pointers to arrays of mutexes (only with MIMPI_THREAD_MULTIPLE):
+pthread_mutex_t* peerMutexes = NULL;    // structures of messages from and to a process
+pthread_mutex_t* sendMutexes = NULL;    // frames written to a process
+
+// Control frame (probe, returned credits, clearance) that waits for the control writer:
+struct ControlFrame {
+    int destination;
+    char frame[FRAME_SIZE];
+    struct ControlFrame* next;
+};
 
-// Global pointer to receiver semaphore:
-sem_t receiverSemaphore;
+// Control frames written by one thread, so receivers never wait for a pipe (all guarded by controlMutex):
+struct ControlFrame* controlHead = NULL;
+struct ControlFrame* controlTail = NULL;
+int controlBusy = 0;            // the control writer is writing a frame taken from the queue
+int controlStarted = 0;
+int controlStopping = 0;
+pthread_t controlWriter;
+pthread_mutex_t controlMutex;
+pthread_cond_t controlCond;
+
+// Global pointer to an array of coalesce buffers (NULL if coalescing is off):
+struct CoalesceBuffer* coalesceBuffers = NULL;
+
+// Flusher sends buffers that waited for MIMPI_COALESCE_USEC when the process makes no calls (guarded by flusherMutex):
+pthread_t coalesceFlusher;
+pthread_mutex_t flusherMutex;
+pthread_cond_t flusherCond;
+int flusherArmed = 0;           // some buffer got its first entry since the flusher has looked at them
+int flusherStopping = 0;
+
+// Deadlock detector (counters are kept for every tag and, under MIMPI_ANY_TAG, for all tags together):
+pthread_mutex_t detectorMutex;
+struct MessageCounter** sentCounters = NULL;
+struct MessageCounter** receivedCounters = NULL;
+int blockedOn = -1;                 // process that a blocked receive waits for (-1 if none)
+struct MessageParameters blockedParameters;
+int blockedEpoch = 0;               // number of the blocking receive
+atomic_int detectedEpoch = 0;       // blocking receive that turned out to be in a deadlock
+int* probeSenders = NULL;           // process that has passed us the last probe of each initiator
+int* probeEpochs = NULL;
+
+// Global pointer to an array of event rings:
+struct EventRing* eventRings = NULL;
 
 // Global pointer to an array of threads:
 pthread_t *threads = NULL;
 
+// Rings shared with the kernel by the io_uring progress engine:
+struct Uring {
+    int desc;
+    void* submissionRing;
+    size_t submissionRingSize;
+    void* completionRing;
+    size_t completionRingSize;
+    struct io_uring_sqe* entries;
+    size_t entriesSize;
+    unsigned* submissionTail;
+    unsigned* submissionMask;
+    unsigned* submissionArray;
+    unsigned* completionHead;
+    unsigned* completionTail;
+    unsigned* completionMask;
+    struct io_uring_cqe* completions;
+};
+
+// Progress engine (MIMPI_URING): one thread reads from all processes through io_uring instead of a thread each:
+int uringEngine = 0;
+struct Uring uring;
+pthread_t uringThread;
+
+// Threads that read from a process are created on first use if MIMPI_LAZY_THREADS is set:
+int lazyThreads = 0;
+atomic_int *threadStarted = NULL;
+pthread_mutex_t threadsMutex;
+
 // Global pointer to an array of final flags:
-int *finalFlags = NULL;
+atomic_int *finalFlags = NULL;
 
 // Global pointers to arrays of descriptors:
 int *mReadDesc = NULL;
@@ -72,7 +436,30 @@ int parentNode = -1;
 int leftChild = -1;
 int rightChild = -1;
 int deadlockDetection = 0;
-
+int deadlockGrace = 0;
+int threadLevel = MIMPI_THREAD_SINGLE;
+int coalesceBytes = 0;
+int coalesceDelay = 0;
+int spinMax = 0;
+int spinLimit = 0;
+int bulkSegment = 0;            // bytes of one message of the transfers with size_t counts
+
+// Statistics (printed by MIMPI_Finalize if MIMPI_STATS is set):
+atomic_long unexpectedBytes = 0;
+atomic_long unexpectedPeak = 0;
+atomic_long rendezvousSends = 0;
+atomic_long stripedSends = 0;
+long queuedSends = 0;
+long queueWaits = 0;
+atomic_long recvSpinHits = 0;
+atomic_long recvSleeps = 0;
+long startupLaunch = -1;            // microseconds from the spawn by mimpirun to MIMPI_Init (-1 if unknown)
+long startupInit = 0;               // microseconds spent in MIMPI_Init
+
+// Progress of the transfers with size_t counts (bytes of the segments that are done):
+atomic_long bulkSent = 0;
+atomic_long bulkReceived = 0;
+atomic_long bulkCollective = 0;
 
 void findNodeRelations() {
     if (worldRank == 0) {
@@ -98,62 +485,89 @@ void findNodeRelations() {
     }
 }
 
-int findMatchingPair(int index) {
-
-    struct SentMessageParameters* current = sentMessages[index];
-    struct SentMessageParameters* previous = NULL;
+void lockPeer(int peer) {
+    if (threadLevel == MIMPI_THREAD_MULTIPLE) {
+        ASSERT_ZERO(pthread_mutex_lock(&peerMutexes[peer]));
+    }
+}
 
-    while (current != NULL) {
+void unlockPeer(int peer) {
+    if (threadLevel == MIMPI_THREAD_MULTIPLE) {
+        ASSERT_ZERO(pthread_mutex_unlock(&peerMutexes[peer]));
+    }
+}
 
-        // If we get a match:
-        if (current->parameters.count == currentDeadlock[index].count && (current->parameters.tag == currentDeadlock[index].tag || currentDeadlock[index].tag == MIMPI_ANY_TAG)) {
+void lockSend(int destination) {
+    if (sendMutexes != NULL) {
+        ASSERT_ZERO(pthread_mutex_lock(&sendMutexes[destination]));
+    }
+}
 
-            if (previous == NULL) {
-                // If the node to be deleted is the head:
-                sentMessages[index] = current->next;
-            } else {
-                // If the node to be deleted is not the head:
-                previous->next = current->next;
-            }
-            free(current);
+void unlockSend(int destination) {
+    if (sendMutexes != NULL) {
+        ASSERT_ZERO(pthread_mutex_unlock(&sendMutexes[destination]));
+    }
+}
 
-            currentDeadlock[index].count = -1;
-            currentDeadlock[index].tag = -1;
-            return 1;
+struct MessageCounter** findCounter(struct MessageCounter** buckets, int peer, int count, long tag) {
+    unsigned int hash = ((unsigned int)peer * 31u + (unsigned int)count) * 31u + (unsigned int)(tag ^ (tag >> CONTEXT_SHIFT));
+    struct MessageCounter** current = &buckets[hash % COUNTER_BUCKETS];
+    while (*current != NULL) {
+        if ((*current)->peer == peer && (*current)->parameters.count == count && (*current)->parameters.tag == tag) {
+            break;
         }
-        previous = current;
-        current = current->next;
+        current = &(*current)->next;
     }
-    return 0;
+    return current;
 }
 
-void addToSentHistory(int index, int count, int tag) {
-    struct SentMessageParameters* newSentMessage = (struct SentMessageParameters*)malloc(sizeof(struct SentMessageParameters));
-    if (newSentMessage == NULL) {
-        perror("Memory allocation error in newSentMessage");
-        exit(EXIT_FAILURE);
-    }
+long getCounter(struct MessageCounter** buckets, int peer, int count, long tag) {
+    struct MessageCounter* counter = *findCounter(buckets, peer, count, tag);
+    return counter == NULL ? 0 : counter->value;
+}
 
-    // Set values:
-    newSentMessage->parameters.count = count;
-    newSentMessage->parameters.tag = tag;
-    newSentMessage->next = NULL;
+void bumpCounter(struct MessageCounter** buckets, int peer, int count, long tag) {
+    struct MessageCounter** place = findCounter(buckets, peer, count, tag);
+    if (*place == NULL) {
+        *place = (struct MessageCounter*)malloc(sizeof(struct MessageCounter));
+        if (*place == NULL) {
+            perror("Memory allocation error in counter");
+            exit(EXIT_FAILURE);
+        }
+        (*place)->peer = peer;
+        (*place)->parameters.count = count;
+        (*place)->parameters.tag = tag;
+        (*place)->value = 0;
+        (*place)->next = NULL;
+    }
+    (*place)->value++;
+}
 
-    // If the list is empty, set the new node as the head:
-    if (sentMessages[index] == NULL) {
-        sentMessages[index] = newSentMessage;
-    } else {
+void freeCounters(struct MessageCounter** buckets) {
+    for(int i = 0; i < COUNTER_BUCKETS; ++i) {
+        struct MessageCounter* current = buckets[i];
+        while (current != NULL) {
+            struct MessageCounter* next = current->next;
+            free(current);
+            current = next;
+        }
+    }
+    free(buckets);
+}
 
-        // Traverse to the end of the list and append the new node:
-        struct SentMessageParameters* current = sentMessages[index];
-        while (current->next != NULL) {
-            current = current->next;
+// Counts the message in the exact tag and in all tags of its context together (that is what MIMPI_ANY_TAG waits for).
+void countMessage(struct MessageCounter** buckets, int peer, int count, long tag) {
+    if (deadlockDetection == 1) {
+        ASSERT_ZERO(pthread_mutex_lock(&detectorMutex));
+        bumpCounter(buckets, peer, count, tag);
+        if (tag != ANY_TAG_OF(tag)) {
+            bumpCounter(buckets, peer, count, ANY_TAG_OF(tag));
         }
-        current->next = newSentMessage;
+        ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
     }
 }
 
-struct WaitingMessageParameters* createWaitingMessage(char* data, int count, int tag) {
+struct WaitingMessageParameters* createWaitingMessage(char* data, int count, long tag, int type, int id) {
     struct WaitingMessageParameters* newWaitingMessage = (struct WaitingMessageParameters*)malloc(sizeof(struct WaitingMessageParameters));
     if (newWaitingMessage == NULL) {
         perror("Memory allocation error in newNode");
@@ -161,9 +575,11 @@ struct WaitingMessageParameters* createWaitingMessage(char* data, int count, int
     }
 
     // Set values:
+    newWaitingMessage->type = type;
     newWaitingMessage->data = data;
     newWaitingMessage->parameters.count = count;
     newWaitingMessage->parameters.tag = tag;
+    newWaitingMessage->id = id;
     newWaitingMessage->next = NULL;
 
     return newWaitingMessage;
@@ -185,1299 +601,5337 @@ void addToWaitingMessages(int index, struct WaitingMessageParameters* newWaiting
     }
 }
 
-void* messThreadFunction(void* arg) {
-    int t = *(int*)arg;
-    free(arg);
-    int readDesc = mReadDesc[t];
-
-    int count;
-    int tag;
-    int digit;
-    int firstSig;
-
-    int passedInfo;
-
-    char smallBuffer[512] = {0};
-
-    // Get messages until you are told not to do that anymore:
-    while(true) {
-
-        // First message, with parameters:
-
-        passedInfo = 0;
-        while (passedInfo != 512) {
-            passedInfo = (int)chrecv(readDesc, smallBuffer, 512);
-            if (passedInfo == -1 || passedInfo == 0) {
-                return NULL;
-            }
+void encodeNumber(char* frame, int first, int last, int value) {
+    for(int i = last; i >= first; --i) {
+        if(value != 0) {
+            frame[i] = (char)(value%10);
+            value /= 10;
+        } else {
+            frame[i] = (char)0;
         }
+    }
+}
 
-        // If that is a point-to-point message:
-        if (smallBuffer[511] == 'm') {
-
-            // First message, with parameters:
-
-            count = 0;
-            tag = 0;
+int decodeNumber(const char* frame, int first, int last) {
+    int value = 0;
+    for(int i = first; i <= last; ++i) {
+        value = value*10 + (int)frame[i];
+    }
+    return value;
+}
 
-            // Decode tag:
-            digit = 1;
-            firstSig = 510;
-            for(int i = 501; i <= 510; ++i) {
-                if(smallBuffer[i] != (char)0) {
-                    firstSig = i;
-                    break;
-                }
-            }
-            for(int i = 510; i >= firstSig; --i) {
-                tag += ((int)smallBuffer[i])*digit;
-                digit *= 10;
-            }
+void encodeTag(char* frame, long tag) {
+    encodeNumber(frame, FRAME_CONTEXT_FIRST, FRAME_CONTEXT_LAST, TAG_CONTEXT(tag));
+    encodeNumber(frame, FRAME_TAG_FIRST, FRAME_TAG_LAST, USER_TAG(tag));
+}
 
-            // Decode count:
-            digit = 1;
-            firstSig = 500;
-            for(int i = 491; i <= 500; ++i) {
-                if(smallBuffer[i] != (char)0) {
-                    firstSig = i;
-                    break;
-                }
-            }
-            for(int i = 500; i >= firstSig; --i) {
-                count += ((int)smallBuffer[i])*digit;
-                digit *= 10;
-            }
+long decodeTag(const char* frame) {
+    return CONTEXT_TAG(decodeNumber(frame, FRAME_CONTEXT_FIRST, FRAME_CONTEXT_LAST),
+                       decodeNumber(frame, FRAME_TAG_FIRST, FRAME_TAG_LAST));
+}
 
-            // Get the rest of first message:
-            char *bigBuffer = (char *)malloc(count * sizeof(char));
-            if (bigBuffer == NULL) {
-                perror("Memory allocation error in bigBuffer");
-                exit(EXIT_FAILURE);
-            }
+// Message with the tag is what the receive waits for (MIMPI_ANY_TAG matches every tag of the same context):
+int tagMatches(long tag, long wanted) {
+    return tag == wanted || wanted == ANY_TAG_OF(tag);
+}
 
-            int remaining = count;
-            int offset = 0;
-            int chunkSize = (remaining > 491) ? 491 : remaining;
+int sendAll(int desc, const void* buffer, size_t size) {
+    size_t offset = 0;
+    while(offset < size) {
+        int passedInfo = (int)chsend(desc, (const char*)buffer + offset, size - offset);
+        if (passedInfo == -1 || passedInfo == 0) {
+            return -1;
+        }
+        offset += passedInfo;
+    }
+    return 0;
+}
 
-            // Get content from first message:
-            memcpy(bigBuffer, smallBuffer, chunkSize);
+// Blocks at a fixed stride, common lengths with copies of constant size (they compile to single moves):
+void copyStrided(uint8_t* packed, uint8_t* memory, int length, long stride, int blocks, int gather) {
+    if (length == 4) {
+        for(int i = 0; i < blocks; ++i, packed += 4, memory += stride) {
+            gather == 1 ? memcpy(packed, memory, 4) : memcpy(memory, packed, 4);
+        }
+    } else if (length == 8) {
+        for(int i = 0; i < blocks; ++i, packed += 8, memory += stride) {
+            gather == 1 ? memcpy(packed, memory, 8) : memcpy(memory, packed, 8);
+        }
+    } else {
+        for(int i = 0; i < blocks; ++i, packed += length, memory += stride) {
+            gather == 1 ? memcpy(packed, memory, length) : memcpy(memory, packed, length);
+        }
+    }
+}
 
-            offset += chunkSize;
-            remaining -= chunkSize;
+// Finds the element, block and offset in the block of byte first of the packed message.
+void findPackedByte(const struct Datatype* type, long first, long* element, int* block, int* inBlock) {
+    *element = first / type->size;
+    *inBlock = (int)(first % type->size);
+    *block = 0;
+    if (type->stride != 0) {
+        *block = *inBlock / type->blocks[0].length;
+        *inBlock %= type->blocks[0].length;
+    } else {
+        while (*inBlock >= type->blocks[*block].length) {
+            *inBlock -= type->blocks[*block].length;
+            (*block)++;
+        }
+    }
+}
 
-            // Other messages, without parameters:
+// Copies bytes [first, first + length) of the packed message between packed and the elements at data,
+// from the elements if gather is 1 and to them otherwise.
+void copyTyped(uint8_t* packed, uint8_t* data, const struct Datatype* type, long first, int length, int gather) {
+    if (length == 0) {
+        return;
+    }
+    long element;
+    int block;
+    int inBlock;
+    findPackedByte(type, first, &element, &block, &inBlock);
+
+    while (length > 0) {
+        uint8_t* memory = data + element * type->extent + type->blocks[block].offset + inBlock;
+        int chunkSize = MIN(length, type->blocks[block].length - inBlock);
+
+        // Whole blocks at a fixed stride go in one loop:
+        if (type->stride != 0 && inBlock == 0 && chunkSize == type->blocks[0].length) {
+            int blocks = MIN(length / chunkSize, type->blockCount - block);
+            copyStrided(packed, memory, chunkSize, type->stride, blocks, gather);
+            chunkSize *= blocks;
+            block += blocks;
+        } else {
+            gather == 1 ? memcpy(packed, memory, chunkSize) : memcpy(memory, packed, chunkSize);
+            block++;
+        }
+        packed += chunkSize;
+        length -= chunkSize;
+        inBlock = 0;
+        if (block == type->blockCount) {
+            block = 0;
+            element++;
+        }
+    }
+}
 
-            while(remaining > 0) {
+// Writes bytes [first, first + length) of the message laid out by type straight from the blocks, returns -1 on failure.
+int sendTyped(int desc, void const *data, const struct Datatype* type, long first, int length) {
+    if (length == 0) {
+        return 0;
+    }
+    long element;
+    int block;
+    int inBlock;
+    findPackedByte(type, first, &element, &block, &inBlock);
+
+    while (length > 0) {
+        const uint8_t* memory = (const uint8_t*)data + element * type->extent + type->blocks[block].offset + inBlock;
+        int chunkSize = MIN(length, type->blocks[block].length - inBlock);
+        if (sendAll(desc, memory, chunkSize) == -1) {
+            return -1;
+        }
+        length -= chunkSize;
+        inBlock = 0;
+        if (++block == type->blockCount) {
+            block = 0;
+            element++;
+        }
+    }
+    return 0;
+}
 
-                chunkSize = (remaining > 512) ? 512 : remaining;
+// Copies bytes [first, first + length) of the message laid out by type (NULL if contiguous) from data to target.
+void gatherMessage(void* target, void const *data, const struct Datatype* type, long first, int length) {
+    if (type == NULL) {
+        memcpy(target, (const uint8_t*)data + first, length);
+    } else {
+        copyTyped((uint8_t*)target, (uint8_t*)data, type, first, length, 1);
+    }
+}
 
-                // Get message:
-                passedInfo = 0;
-                while(passedInfo != 512) {
-                    passedInfo = (int)chrecv(readDesc, smallBuffer, 512);
-                    if (passedInfo == -1 || passedInfo == 0) {
-                        return NULL;
-                    }
-                }
+// Copies length bytes from source to bytes [first, first + length) of the message laid out by type in data.
+void scatterMessage(void* data, const void* source, const struct Datatype* type, long first, int length) {
+    if (type == NULL) {
+        memcpy((uint8_t*)data + first, source, length);
+    } else {
+        copyTyped((uint8_t*)source, (uint8_t*)data, type, first, length, 0);
+    }
+}
 
-                // Get content:
-                memcpy(bigBuffer + offset, smallBuffer, chunkSize);
+struct FrameReader {
+    int source;
 
-                offset += chunkSize;
-                remaining -= chunkSize;
-            }
+    // Frame that is being collected:
+    char frame[FRAME_SIZE];
+    int framePosition;
 
-            // Create a node for new message to put it in waiting messages:
-            struct WaitingMessageParameters* newWaitingMessage = createWaitingMessage(bigBuffer, count, tag);
+    // Point-to-point message that is being collected:
+    char* message;
+    int type;
+    int count;
+    long tag;
+    int messageOffset;
+    int end;            // bytes of the message that come on this channel
+    int striped;        // number of the striped message (0 if it is not striped)
+    int padding;
+};
 
-            sem_wait(&arrayOfSemaphores[t]);
+void futexWait(atomic_int* word, int value, const struct timespec* timeout) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
 
-            // Put new message in waiting messages:
-            addToWaitingMessages(t, newWaitingMessage);
+void futexWake(atomic_int* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
-            // Check if the main thread (receiver) waits for that message from that process:
-            if(currentReceiver[t].count == count && (currentReceiver[t].tag == tag || currentReceiver[t].tag == MIMPI_ANY_TAG)) {
-                sem_post(&receiverSemaphore);
-            } else {
-                sem_post(&arrayOfSemaphores[t]);
-            }
+// Futexes in the shared segment are waited on by other processes too:
+void futexWaitShared(atomic_int* word, int value) {
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
 
-        // If that is a final message:
-        } else if(smallBuffer[511] == 'f') {
+void futexWakeShared(atomic_int* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
 
-            // Changes to apply in send logic:
-            ASSERT_SYS_OK(close(mReadDesc[t]));
-            mReadDesc[t] = -1;
-            ASSERT_SYS_OK(close(mWriteDesc[t]));
-            mWriteDesc[t] = -1;
+void claimWaiter(struct EventRing* ring, unsigned int waiter, int reason) {
+    if (atomic_compare_exchange_strong(&ring->waiter, &waiter, waiter + 1)) {
+        atomic_store(&ring->wakeReason, reason);
+        futexWake(&ring->wakeReason);
+    }
+}
 
-            sem_wait(&arrayOfSemaphores[t]);
+// Wakes the main thread only if it sleeps on a receive that the event settles, with the reason.
+void wakeWaiter(struct EventRing* ring, int type, int count, long tag) {
+    unsigned int waiter = atomic_load(&ring->waiter);
+    if (waiter % 2 == 0) {
+        return;
+    }
 
-            // Changes to apply in receiver logic:
-            finalFlags[t] = 1;
-            if(currentReceiver[t].count != -1 && currentReceiver[t].tag != -1) {
-                sem_post(&receiverSemaphore);
-            } else {
-                sem_post(&arrayOfSemaphores[t]);
-            }
+    int reason = WAKE_NONE;
+    if (type == EVENT_PAYLOAD) {
+        reason = WAKE_MESSAGE;  // only one rendezvous receive at a time
+    } else if (type == EVENT_MESSAGE || type == EVENT_RTS) {
+        int waitCount = atomic_load_explicit(&ring->waitCount, memory_order_relaxed);
+        long waitTag = atomic_load_explicit(&ring->waitTag, memory_order_relaxed);
+        if (waitCount == count && tagMatches(tag, waitTag)) {
+            reason = WAKE_MESSAGE;
+        }
+    } else if (type == EVENT_FINAL) {
+        reason = WAKE_FINAL;
+    }
 
-            // There won't be any new messages from that process:
-            return NULL;
+    // Parameters belong to that very receive only if it has not been disarmed in the meantime:
+    if (reason != WAKE_NONE) {
+        claimWaiter(ring, waiter, reason);
+    }
+}
 
-        // If that is a deadlock message:
-        } else if(deadlockDetection == 1) {
-            //mamy komunikat deadlock - trzeba rozszyfrować count i tag, dodać i ew. przyciąć:
+int ringHasEvents(int source) {
+    struct EventRing* ring = &eventRings[source];
+    return atomic_load(&ring->tail) != atomic_load(&ring->head) || atomic_load(&ring->overflowCount) > 0;
+}
 
-            count = 0;
-            tag = 0;
+void completePostedReceive(struct PostedReceive** previousNext, int status) {
+    struct PostedReceive* posted = *previousNext;
+    *previousNext = posted->next;
+    posted->status = status;
+    ASSERT_ZERO(pthread_cond_signal(&posted->cond));
+}
 
-            // Decode tag:
-            digit = 1;
-            firstSig = 510;
-            for(int i = 501; i <= 510; ++i) {
-                if(smallBuffer[i] != (char)0) {
-                    firstSig = i;
-                    break;
-                }
-            }
-            for(int i = 510; i >= firstSig; --i) {
-                tag += ((int)smallBuffer[i])*digit;
-                digit *= 10;
-            }
+// Control writer, writes queued control frames in order.
+void* controlWriterFunction(void* arg) {
+    (void)arg;
 
-            // Decode count:
-            digit = 1;
-            firstSig = 500;
-            for(int i = 491; i <= 500; ++i) {
-                if(smallBuffer[i] != (char)0) {
-                    firstSig = i;
-                    break;
-                }
-            }
-            for(int i = 500; i >= firstSig; --i) {
-                count += ((int)smallBuffer[i])*digit;
-                digit *= 10;
-            }
+    // Destination may exit before its frames are written:
+    sigset_t blocked;
+    ASSERT_SYS_OK(sigemptyset(&blocked));
+    ASSERT_SYS_OK(sigaddset(&blocked, SIGPIPE));
+    ASSERT_ZERO(pthread_sigmask(SIG_BLOCK, &blocked, NULL));
 
-            sem_wait(&arrayOfSemaphores[t]);
+    ASSERT_ZERO(pthread_mutex_lock(&controlMutex));
+    while (true) {
+        while (controlHead == NULL && controlStopping == 0) {
+            ASSERT_ZERO(pthread_cond_wait(&controlCond, &controlMutex));
+        }
+        if (controlHead == NULL) {
+            break;
+        }
 
-            // Update deadlock parameters:
-            currentDeadlock[t].count = count;
-            currentDeadlock[t].tag = tag;
+        struct ControlFrame* entry = controlHead;
+        controlHead = entry->next;
+        if (controlHead == NULL) {
+            controlTail = NULL;
+        }
+        controlBusy = 1;
+        ASSERT_ZERO(pthread_mutex_unlock(&controlMutex));
 
-            //Chcek if that deadlock message can be ignored and if not - check if the main thread (receiver) waits for a message from that process:
-            if(findMatchingPair(t) == 0 && (currentReceiver[t].count != -1 && currentReceiver[t].tag != -1)) {
-                sem_post(&receiverSemaphore);
-            } else {
-                sem_post(&arrayOfSemaphores[t]);
-            }
+        // A process that has finished does not get it:
+        lockSend(entry->destination);
+        if (mWriteDesc[entry->destination] != -1) {
+            sendAll(mWriteDesc[entry->destination], entry->frame, FRAME_SIZE);
         }
+        unlockSend(entry->destination);
 
+        ASSERT_ZERO(pthread_mutex_lock(&controlMutex));
+        controlBusy = 0;
+        free(entry);
+        ASSERT_ZERO(pthread_cond_broadcast(&controlCond));
     }
+    ASSERT_ZERO(pthread_mutex_unlock(&controlMutex));
 
+    return NULL;
 }
 
-void MIMPI_Init(bool enable_deadlock_detection) {
-
-    channels_init();
-
-    // Envirinment variable - worldSize:
-    char *envWorldSize = getenv("MIMPI_ENV_WORLD_SIZE");
-    if (envWorldSize == NULL) {
-        perror("Environment variable error in MIMPI_ENV_WORLD_SIZE");
+// Leaves the frame to the control writer. Receiver threads send control frames too, and a receiver that waited
+// for a full pipe would stop reading the pipe that the other process may be waiting for.
+void queueControl(int destination, const char* frame) {
+    struct ControlFrame* entry = (struct ControlFrame*)malloc(sizeof(struct ControlFrame));
+    if (entry == NULL) {
+        perror("Memory allocation error in control frame");
         exit(EXIT_FAILURE);
     }
-    worldSize = (int)strtol(envWorldSize, NULL, 10);
-    if (unsetenv("MIMPI_ENV_WORLD_SIZE") != 0) {
-        fprintf(stderr, "Unsetting env variable MIMPI_ENV_WORLD_SIZE failed\n");
-        exit(EXIT_FAILURE);
+    entry->destination = destination;
+    memcpy(entry->frame, frame, FRAME_SIZE);
+    entry->next = NULL;
+
+    ASSERT_ZERO(pthread_mutex_lock(&controlMutex));
+    if (controlTail == NULL) {
+        controlHead = entry;
+    } else {
+        controlTail->next = entry;
     }
+    controlTail = entry;
+    if (controlStarted == 0) {
+        ASSERT_ZERO(pthread_create(&controlWriter, NULL, controlWriterFunction, NULL));
+        controlStarted = 1;
+    }
+    ASSERT_ZERO(pthread_cond_broadcast(&controlCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&controlMutex));
+}
 
-    // Envirinment variable - worldRank:
-    char *envWorldRank = getenv("MIMPI_ENV_WORLD_RANK");
-    if (envWorldRank == NULL) {
-        perror("Environment variable error in MIMPI_ENV_WORLD_RANK");
-        exit(EXIT_FAILURE);
+// Waits until every queued control frame is written.
+void waitForControl() {
+    ASSERT_ZERO(pthread_mutex_lock(&controlMutex));
+    while (controlHead != NULL || controlBusy == 1) {
+        ASSERT_ZERO(pthread_cond_wait(&controlCond, &controlMutex));
     }
-    worldRank = (int)strtol(envWorldRank, NULL, 10);
-    if (unsetenv("MIMPI_ENV_WORLD_RANK") != 0) {
-        fprintf(stderr, "Unsetting env variable MIMPI_ENV_WORLD_RANK failed\n");
-        exit(EXIT_FAILURE);
+    ASSERT_ZERO(pthread_mutex_unlock(&controlMutex));
+}
+
+// Stops the control writer, frames queued after our channels were closed are dropped.
+void finalizeControl() {
+    ASSERT_ZERO(pthread_mutex_lock(&controlMutex));
+    controlStopping = 1;
+    ASSERT_ZERO(pthread_cond_broadcast(&controlCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&controlMutex));
+    if (controlStarted == 1) {
+        ASSERT_ZERO(pthread_join(controlWriter, NULL));
     }
+    controlStarted = 0;
+    controlStopping = 0;
+    ASSERT_ZERO(pthread_mutex_destroy(&controlMutex));
+    ASSERT_ZERO(pthread_cond_destroy(&controlCond));
+}
 
-    // Find node relations:
-    findNodeRelations();
+// Sends a frame with one number (in place of count) to the destination.
+void sendControl(int destination, char type, int value) {
+    char frame[FRAME_SIZE] = {0};
+    frame[FRAME_TYPE] = type;
+    encodeNumber(frame, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, value);
+    queueControl(destination, frame);
+}
 
-    // Waiting messages structure:
-    waitingMessages = (struct WaitingMessageParameters**)malloc(worldSize * sizeof(struct WaitingMessageParameters*));
-    if (waitingMessages == NULL) {
-        perror("Memory allocation error in waitingMessages");
-        exit(EXIT_FAILURE);
+// Eager message from the source has been received, its bytes may be sent again.
+void returnCredit(int source, int count) {
+    if (eagerCredit == 0) {
+        return;
     }
+    atomic_fetch_sub(&unexpectedBytes, count);
 
-    // Current receiver structure:
-    currentReceiver = (struct MessageParameters *) malloc(worldSize * sizeof(struct MessageParameters));
-    if (currentReceiver == NULL) {
-        perror("Memory allocation error in currentReceiver");
-        exit(EXIT_FAILURE);
+    // Credits go back in batches, the sender has at least half of them all the time:
+    returnedCredits[source] += count;
+    if (returnedCredits[source] >= MAX(eagerCredit / 2, 1)) {
+        sendControl(source, 'c', (int)returnedCredits[source]);
+        returnedCredits[source] = 0;
     }
+}
 
-    // Final flags structure:
-    finalFlags = (int *)malloc(worldSize * sizeof(int));
-    if (finalFlags == NULL) {
-        perror("Memory allocation error in finalFlags");
+// Lets the sender of a matched request to send write the data (the source always waits for it).
+void clearToSend(int source, int id) {
+    sendControl(source, 'a', id);
+}
+
+void grantClearance(int t, int id) {
+    struct Clearance* clearance = (struct Clearance*)malloc(sizeof(struct Clearance));
+    if (clearance == NULL) {
+        perror("Memory allocation error in clearance");
         exit(EXIT_FAILURE);
     }
+    clearance->id = id;
 
-    // Array of semaphores structure:
-    arrayOfSemaphores = (sem_t*)malloc(worldSize * sizeof(sem_t));
-    if (arrayOfSemaphores == NULL) {
-        perror("Memory allocation error in arrayOfSemaphores");
-        exit(EXIT_FAILURE);
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    clearance->next = clearances[t];
+    clearances[t] = clearance;
+    ASSERT_ZERO(pthread_cond_broadcast(&clearanceCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+}
+
+// Clearance mutex has to be held.
+int takeClearance(int destination, int id) {
+    struct Clearance** previousNext = &clearances[destination];
+    while (*previousNext != NULL) {
+        if ((*previousNext)->id == id) {
+            struct Clearance* clearance = *previousNext;
+            *previousNext = clearance->next;
+            free(clearance);
+            return 1;
+        }
+        previousNext = &(*previousNext)->next;
     }
+    return 0;
+}
 
-    // Receiver semaphore:
-    ASSERT_SYS_OK(sem_init(&receiverSemaphore, 0, 0));   // Initial value 0
+// Delivery with MIMPI_THREAD_MULTIPLE, messages go straight to the oldest matching posted receive.
+void deliverToPosted(int t, int type, char* data, int count, long tag, int id) {
+    lockPeer(t);
+
+    struct PostedReceive** previousNext = &postedReceives[t];
+    if (type == EVENT_MESSAGE || type == EVENT_RTS) {
+        while (*previousNext != NULL) {
+            struct PostedReceive* posted = *previousNext;
+            if (posted->rendezvousId == -1 && posted->parameters.count == count && tagMatches(tag, posted->parameters.tag)) {
+
+                // Receive waits for the data now:
+                if (type == EVENT_RTS) {
+                    posted->parameters.tag = tag;
+                    posted->rendezvousId = id;
+                    clearToSend(t, id);
+                    unlockPeer(t);
+                    return;
+                }
 
-    // Initializations:
-    for(int i = 0; i < worldSize; ++i) {
-        waitingMessages[i] = NULL;
+                scatterMessage(posted->data, data, posted->type, 0, count);
+                free(data);
+                posted->parameters.tag = tag;
+                countMessage(receivedCounters, t, count, tag);
+                returnCredit(t, count);
+                completePostedReceive(previousNext, MIMPI_SUCCESS);
+                unlockPeer(t);
+                return;
+            }
+            previousNext = &posted->next;
+        }
+        addToWaitingMessages(t, createWaitingMessage(data, count, tag, type, id));
+
+    } else if (type == EVENT_PAYLOAD) {
+        while (*previousNext != NULL) {
+            struct PostedReceive* posted = *previousNext;
+            if (posted->rendezvousId == id) {
+                scatterMessage(posted->data, data, posted->type, 0, count);
+                free(data);
+                countMessage(receivedCounters, t, count, posted->parameters.tag);
+                completePostedReceive(previousNext, MIMPI_SUCCESS);
+                unlockPeer(t);
+                return;
+            }
+            previousNext = &posted->next;
+        }
+        addToWaitingMessages(t, createWaitingMessage(data, count, tag, type, id));
 
-        currentReceiver[i].count = -1;
-        currentReceiver[i].tag = -1;
+    } else {
+        while (*previousNext != NULL) {
+            completePostedReceive(previousNext, MIMPI_ERROR_REMOTE_FINISHED);
+        }
+    }
 
-        finalFlags[i] = 0;
+    unlockPeer(t);
+}
 
-        ASSERT_SYS_OK(sem_init(&arrayOfSemaphores[i], 0, 1));  // Initial value 1 (mutex)
+void pushEvent(int t, int type, char* data, int count, long tag, int id) {
+    if (threadLevel == MIMPI_THREAD_MULTIPLE) {
+        deliverToPosted(t, type, data, count, tag, id);
+        return;
     }
 
-    // Deadlock detection:
-    if (enable_deadlock_detection == true) {
+    struct EventRing* ring = &eventRings[t];
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
 
-        // Deadlock detection flag:
-        deadlockDetection = 1;
+    // Lock-free path, the ring is not full and nothing waits in the overflow list:
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) < RING_SIZE && atomic_load(&ring->overflowCount) == 0) {
+        struct Event* event = &ring->events[tail % RING_SIZE];
+        event->type = type;
+        event->parameters.count = count;
+        event->parameters.tag = tag;
+        event->id = id;
+        event->data = data;
+        atomic_store(&ring->tail, tail + 1);
 
-        // Sent messages structure:
-        sentMessages = (struct SentMessageParameters**) malloc(worldSize * sizeof(struct SentMessageParameters*));
-        if (sentMessages == NULL) {
-            perror("Memory allocation error in sentMessages");
+    // Fallback, the consumer does not keep up:
+    } else {
+        struct Event* event = (struct Event*)malloc(sizeof(struct Event));
+        if (event == NULL) {
+            perror("Memory allocation error in event");
             exit(EXIT_FAILURE);
         }
+        event->type = type;
+        event->parameters.count = count;
+        event->parameters.tag = tag;
+        event->id = id;
+        event->data = data;
+        event->next = NULL;
+
+        ASSERT_ZERO(pthread_mutex_lock(&ring->overflowMutex));
+        if (ring->overflowTail == NULL) {
+            ring->overflowHead = event;
+        } else {
+            ring->overflowTail->next = event;
+        }
+        ring->overflowTail = event;
+        atomic_fetch_add(&ring->overflowCount, 1);
+        ASSERT_ZERO(pthread_mutex_unlock(&ring->overflowMutex));
+    }
 
-        // Current deadlock structure:
-        currentDeadlock = (struct MessageParameters *) malloc(worldSize * sizeof(struct MessageParameters));
-        if (currentDeadlock == NULL) {
-            perror("Memory allocation error in currentDeadlock");
-            exit(EXIT_FAILURE);
+    wakeWaiter(ring, type, count, tag);
+}
+
+void deliverMessage(int t, char* data, int count, long tag) {
+
+    // Eager message waits in memory until it is received:
+    if (eagerCredit > 0) {
+        long bytes = atomic_fetch_add(&unexpectedBytes, count) + count;
+        long peak = atomic_load(&unexpectedPeak);
+        while (bytes > peak && !atomic_compare_exchange_weak(&unexpectedPeak, &peak, bytes)) {
         }
+    }
+    pushEvent(t, EVENT_MESSAGE, data, count, tag, 0);
+}
 
-        // Initializations:
-        for(int i = 0; i < worldSize; ++i) {
-            sentMessages[i] = NULL;
+// First byte of part of a striped message:
+long partStart(int count, int part) {
+    return (long)count * part / stripes;
+}
+
+void completeMessage(struct FrameReader* reader) {
 
-            currentDeadlock[i].count = -1;
-            currentDeadlock[i].tag = -1;
+    // Striped message is complete when readers of other channels have got their parts (in the meantime):
+    if (reader->striped != 0) {
+        struct Assembly* assembly = &assemblies[reader->source];
+        ASSERT_ZERO(pthread_mutex_lock(&assembly->mutex));
+        while (assembly->partsLeft > 0 && assembly->lowestEnded >= assembly->id) {
+            ASSERT_ZERO(pthread_cond_wait(&assembly->cond, &assembly->mutex));
         }
+        int complete = assembly->partsLeft == 0;
+        assembly->id = 0;
+        assembly->message = NULL;
 
+        // Some channel has ended, others may still be reading their parts into the buffer:
+        while (assembly->writers > 0) {
+            ASSERT_ZERO(pthread_cond_wait(&assembly->cond, &assembly->mutex));
+        }
+        ASSERT_ZERO(pthread_mutex_unlock(&assembly->mutex));
+        reader->striped = 0;
+
+        // Sender has died in the middle of the message:
+        if (complete == 0) {
+            free(reader->message);
+            reader->message = NULL;
+            return;
+        }
     }
 
-    // Point-to-point message descriptors structure:
-    mReadDesc = (int *)malloc(worldSize * sizeof(int));
-    if (mReadDesc == NULL) {
-        perror("Memory allocation error in mReadDesc");
-        exit(EXIT_FAILURE);
-    }
-    mWriteDesc = (int *)malloc(worldSize * sizeof(int));
-    if (mWriteDesc == NULL) {
-        perror("Memory allocation error in mWriteDesc");
-        exit(EXIT_FAILURE);
+    if (reader->type == EVENT_PAYLOAD) {
+        pushEvent(reader->source, EVENT_PAYLOAD, reader->message, reader->count, -1, (int)reader->tag);
+    } else {
+        deliverMessage(reader->source, reader->message, reader->count, reader->tag);
     }
+    reader->message = NULL;
+}
 
-    // Group message descriptors structure:
-    gReadDesc = (int *)malloc(3 * sizeof(int)); //(0 = góra , 1 = dół/lewo , 2 = dół/prawo)
-    if (gReadDesc == NULL) {
-        perror("Memory allocation error in gReadDesc");
-        exit(EXIT_FAILURE);
-    }
-    gWriteDesc = (int *)malloc(3 * sizeof(int)); //(0 = góra , 1 = dół/lewo , 2 = dół/prawo)
-    if (gWriteDesc == NULL) {
-        perror("Memory allocation error in gWriteDesc");
-        exit(EXIT_FAILURE);
+// Frees the message that was being read when the main channel ended. Readers of other channels may be reading
+// parts of a striped one into it, the buffer goes once they have stopped.
+void dropMessage(struct FrameReader* reader) {
+    if (reader->striped != 0) {
+        struct Assembly* assembly = &assemblies[reader->source];
+        ASSERT_ZERO(pthread_mutex_lock(&assembly->mutex));
+        assembly->id = 0;
+        assembly->message = NULL;
+        while (assembly->writers > 0) {
+            ASSERT_ZERO(pthread_cond_wait(&assembly->cond, &assembly->mutex));
+        }
+        ASSERT_ZERO(pthread_mutex_unlock(&assembly->mutex));
+        reader->striped = 0;
     }
+    free(reader->message);
+    reader->message = NULL;
+}
 
-    // Places for group descriptors that are not used:
-    if(parentNode == -1) {
-        gReadDesc[0] = -1;
-        gWriteDesc[0] = -1;
+// With detected != 0 the receive of that epoch ends only after the frame is queued,
+// MIMPI_Finalize writes queued frames before the final frame of this process.
+void sendProbe(int destination, int initiator, int epoch, int count, long tag, long consumed, int confirm, int detected) {
+    char probe[FRAME_SIZE] = {0};
+    probe[FRAME_TYPE] = 'd';
+    probe[PROBE_CONFIRM] = (char)confirm;
+    encodeNumber(probe, PROBE_INITIATOR_FIRST, PROBE_INITIATOR_LAST, initiator);
+    encodeNumber(probe, PROBE_EPOCH_FIRST, PROBE_EPOCH_LAST, epoch);
+    encodeNumber(probe, PROBE_CONSUMED_FIRST, PROBE_CONSUMED_LAST, (int)consumed);
+    encodeTag(probe, tag);
+    encodeNumber(probe, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, count);
+
+    // If the process has finished, the receive that waits for it ends anyway:
+    queueControl(destination, probe);
+    if (detected != 0) {
+        atomic_store(&detectedEpoch, detected);
     }
+}
 
-    if(leftChild == -1) {
-        gReadDesc[1] = -1;
-        gWriteDesc[1] = -1;
+// Blocked receive has waited for longer than the grace period - ask the process it waits for.
+void startProbe() {
+    ASSERT_ZERO(pthread_mutex_lock(&detectorMutex));
+    int destination = blockedOn;
+    int epoch = blockedEpoch;
+    struct MessageParameters parameters = blockedParameters;
+    long consumed = getCounter(receivedCounters, blockedOn, parameters.count, parameters.tag);
+    ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
+
+    if (destination != -1) {
+        sendProbe(destination, worldRank, epoch, parameters.count, parameters.tag, consumed, 0, 0);
     }
+}
 
-    if(rightChild == -1) {
-        gReadDesc[2] = -1;
-        gWriteDesc[2] = -1;
+void reportDeadlock(int source) {
+    unsigned int waiter = atomic_load(&eventRings[source].waiter);
+    if (waiter % 2 == 1) {
+        claimWaiter(&eventRings[source], waiter, WAKE_DEADLOCK);
     }
+}
 
-    int mReadDescInd = 0;
-    int mWriteDescInd = 0;
-    int k = 0;
-    for(int j = 0; j < worldSize*(worldSize-1) + 2*(worldSize-1); ++j) {
-        if(j != k && j%(worldSize-1) == 0 && k < worldSize) {
-            k++;
+// Edge-chasing: process t waits for us and we have not sent it anything it could still receive.
+// If we wait too, the probe goes further, and when it comes back to its initiator - there is a cycle.
+// The initiator then sends a confirmation back along the path of the probe. Each process passes it on
+// before it reports the deadlock, so it always comes before the final frame of a process that has left.
+void handleProbe(int t, const char* probe) {
+    int confirm = probe[PROBE_CONFIRM];
+    int initiator = decodeNumber(probe, PROBE_INITIATOR_FIRST, PROBE_INITIATOR_LAST);
+    int epoch = decodeNumber(probe, PROBE_EPOCH_FIRST, PROBE_EPOCH_LAST);
+    long consumed = decodeNumber(probe, PROBE_CONSUMED_FIRST, PROBE_CONSUMED_LAST);
+    long tag = decodeTag(probe);
+    int count = decodeNumber(probe, FRAME_COUNT_FIRST, FRAME_COUNT_LAST);
+
+    ASSERT_ZERO(pthread_mutex_lock(&detectorMutex));
+
+    int destination = blockedOn;
+    int ownEpoch = blockedEpoch;
+    struct MessageParameters parameters = blockedParameters;
+
+    // Confirmation comes from the process we wait for:
+    if (confirm == 1) {
+        int previous = probeSenders[initiator];
+        int valid = (initiator != worldRank && t == blockedOn && previous != -1 && probeEpochs[initiator] == epoch);
+        if (valid) {
+            probeSenders[initiator] = -1;
         }
+        ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
 
-        // Places for point-to-point descriptors that are not used:
-
-        if(mReadDescInd == worldRank) {
-            mReadDesc[mReadDescInd] = -1;
-            mReadDescInd++;
+        if (valid) {
+            sendProbe(previous, initiator, epoch, count, tag, 0, 1, ownEpoch);
+            reportDeadlock(destination);
         }
-        if(mWriteDescInd == worldRank) {
-            mWriteDesc[mWriteDescInd] = -1;
-            mWriteDescInd++;
-        }
-
-            // Descriptors for point-to-point messages:
+        return;
+    }
 
-        if(worldRank*(worldSize-1) <= j && j < (worldRank+1)*(worldSize-1)) {
-            mReadDesc[mReadDescInd] = DESC_SHIFT + j*2 ;
-            mReadDescInd++;
-        } else if(j < worldRank*(worldSize-1) && j == k*(worldSize-1)+worldRank-1) {
-            mWriteDesc[mWriteDescInd] = DESC_SHIFT + j*2 + 1;
-            mWriteDescInd++;
-        } else if((worldRank+1)*(worldSize-1) <= j && j < worldSize*(worldSize-1) && j == k*(worldSize-1)+worldRank) {
-            mWriteDesc[mWriteDescInd] = DESC_SHIFT + j*2 + 1;
-            mWriteDescInd++;
+    // We do not wait, or a matching message is on its way to t:
+    if (blockedOn == -1 || getCounter(sentCounters, t, count, tag) > consumed) {
+        ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
+        return;
+    }
 
-            // Descriptors for group messages:
+    if (initiator == worldRank) {
+        int found = (ownEpoch == epoch);
+        ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
 
-        } else if (j == worldSize*(worldSize-1) + 2*(worldRank-1) && parentNode != -1) {
-            gReadDesc[0] = DESC_SHIFT + j*2;
-        } else if (j == worldSize*(worldSize-1) + 2*(worldRank-1) + 1 && parentNode != -1) {
-            gWriteDesc[0] = DESC_SHIFT + j*2 + 1;
-        } else if (j == worldSize*(worldSize-1) + 4*worldRank && leftChild != -1) {
-            gWriteDesc[1] = DESC_SHIFT + j*2 + 1;
-        } else if (j == worldSize*(worldSize-1) + 4*worldRank + 1 && leftChild != -1) {
-            gReadDesc[1] = DESC_SHIFT + j*2;
-        } else if (j == worldSize*(worldSize-1) + 4*worldRank+2 && rightChild != -1) {
-            gWriteDesc[2] = DESC_SHIFT + j*2 + 1;
-        } else if (j == worldSize*(worldSize-1) + 4*worldRank+2 + 1 && rightChild != -1) {
-            gReadDesc[2] = DESC_SHIFT + j*2;
+        if (found) {
+            sendProbe(t, initiator, epoch, count, tag, 0, 1, epoch);
+            reportDeadlock(destination);
         }
+        return;
     }
 
-    // Threads:
-    threads = (pthread_t *)malloc((worldSize-1) * sizeof(pthread_t));
-    if (threads == NULL) {
-        perror("Memory allocation error in threads");
-        exit(EXIT_FAILURE);
-    }
+    probeSenders[initiator] = t;
+    probeEpochs[initiator] = epoch;
+    long ownConsumed = getCounter(receivedCounters, blockedOn, parameters.count, parameters.tag);
+    ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
 
-    for(int t = 0; t < worldSize-1; ++t) {
-        int* worker_arg = malloc(sizeof(int));
-        if (worker_arg == NULL) {
-            perror("Memory allocation error in worker_arg");
-            exit(EXIT_FAILURE);
-        }
-        *worker_arg = t < worldRank ? t : t+1;
-        ASSERT_ZERO(pthread_create(&threads[t], NULL, messThreadFunction, worker_arg));
+    sendProbe(destination, initiator, epoch, parameters.count, parameters.tag, ownConsumed, 0, 0);
+}
 
+// Publishes a receive that is going to block (returns its epoch) or withdraws it (source = -1).
+int setBlocked(int source, int count, long tag) {
+    ASSERT_ZERO(pthread_mutex_lock(&detectorMutex));
+    if (source != -1) {
+        blockedEpoch++;
     }
+    blockedOn = source;
+    blockedParameters.count = count;
+    blockedParameters.tag = tag;
+    int epoch = blockedEpoch;
+    ASSERT_ZERO(pthread_mutex_unlock(&detectorMutex));
+    return epoch;
 }
 
-void MIMPI_Finalize() {
+// The process has closed its channel to us (in MIMPI_Finalize or because it exited):
+void finishPeer(int t) {
 
-    // Message for every other process that we execute finalize:
-    int passedInfo;
-    char messBuffer[512] = {0};
+    // Changes to apply in send logic:
+    ASSERT_SYS_OK(close(mReadDesc[t]));
+    mReadDesc[t] = -1;
+    lockSend(t);
+    if (mWriteDesc[t] != -1) {
+        ASSERT_SYS_OK(close(mWriteDesc[t]));
+        mWriteDesc[t] = -1;
+    }
+    unlockSend(t);
+
+    // Readers of other channels won't get the buffers of new striped messages:
+    if (stripes > 1) {
+        ASSERT_ZERO(pthread_mutex_lock(&assemblies[t].mutex));
+        assemblies[t].id = 0;
+        assemblies[t].message = NULL;
+        assemblies[t].mainEnded = 1;
+        ASSERT_ZERO(pthread_cond_broadcast(&assemblies[t].cond));
+        ASSERT_ZERO(pthread_mutex_unlock(&assemblies[t].mutex));
+    }
 
-    for(int i = 0; i< worldSize; ++i) {
-        if(i == worldRank) {
-            continue;
-        }
+    // Changes to apply in receiver logic:
+    finalFlags[t] = 1;
+    pushEvent(t, EVENT_FINAL, NULL, -1, -1, -1);
 
-        // Send message:
-        messBuffer[511] = 'f';
-        passedInfo = 0;
-        while (passedInfo != 512) {
-            passedInfo = (int)chsend(mWriteDesc[i], messBuffer, 512);
-            if(passedInfo == 0 || passedInfo == -1) {
-                break;
-            }
-        }
+    // Rendezvous sends to that process won't be cleared:
+    if (eagerCredit > 0) {
+        ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+        ASSERT_ZERO(pthread_cond_broadcast(&clearanceCond));
+        ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
     }
+}
 
-    char result = 'd';
-    while(result != 'f') {
-        result = 'f';
+// Acts on a frame with parameters that has just been read whole.
+void handleFrame(struct FrameReader* reader) {
+    int t = reader->source;
+    char* smallBuffer = reader->frame;
 
-        // Left child:
-        if(leftChild != -1) {
-            // Get message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[1], messBuffer, 512);
-                if(passedInfo == 0 || passedInfo == -1) {
-                    messBuffer[511] = 'f';
-                    break;
-                }
-            }
-            // Update result:
-            if(messBuffer[511] != 'f') {
-                result = 'd';
-            }
-            messBuffer[511] = 0;
+    // If that is a point-to-point message (or data of a rendezvous one, with its number in place of tag):
+    if (smallBuffer[FRAME_TYPE] == 'm' || smallBuffer[FRAME_TYPE] == 'p') {
+
+        reader->type = smallBuffer[FRAME_TYPE] == 'm' ? EVENT_MESSAGE : EVENT_PAYLOAD;
+        reader->tag = decodeTag(smallBuffer);
+        reader->count = decodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST);
+
+        reader->message = (char *)malloc(reader->count * sizeof(char));
+        if (reader->message == NULL) {
+            perror("Memory allocation error in bigBuffer");
+            exit(EXIT_FAILURE);
         }
 
-        // Right child:
-        if(rightChild != -1) {
-            // Get message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[2], messBuffer, 512);
-                if(passedInfo == 0 || passedInfo == -1) {
-                    messBuffer[511] = 'f';
-                    break;
-                }
-            }
-            // Update result:
-            if(messBuffer[511] != 'f') {
-                result = 'd';
-            }
-            messBuffer[511] = 0;
+        // Get content from first frame:
+        int chunkSize = MIN(reader->count, FIRST_PAYLOAD_SIZE);
+        memcpy(reader->message, smallBuffer, chunkSize);
+        reader->messageOffset = chunkSize;
+        reader->end = reader->count;
 
+        // Other frames, without parameters, are padded up to the frame size:
+        int continuation = reader->count - chunkSize;
+        reader->padding = (FRAME_SIZE - continuation%FRAME_SIZE) % FRAME_SIZE;
+
+        if (reader->messageOffset == reader->end) {
+            completeMessage(reader);
         }
 
-        // Parent:
-        if(parentNode != -1) {
-            // Update result:
-            messBuffer[511] = result;
-            // Send message:
-            passedInfo = 0;
-            while (passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[0], messBuffer, 512);
-                if(passedInfo == 0 || passedInfo == -1) {
-                    messBuffer[511] = 'f';
-                    break;
-                }
-            }
-            // Get message:
-            passedInfo = 0;
-            while (passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[0], messBuffer, 512);
-                if(passedInfo == 0 || passedInfo == -1) {
-                    messBuffer[511] = 'f';
-                    break;
-                }
+    // If that is the header of a striped message, its first part follows on this channel:
+    } else if (smallBuffer[FRAME_TYPE] == 's') {
+
+        reader->type = smallBuffer[STRIPE_KIND] == 'm' ? EVENT_MESSAGE : EVENT_PAYLOAD;
+        reader->tag = decodeTag(smallBuffer);
+        reader->count = decodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST);
+        reader->striped = decodeNumber(smallBuffer, STRIPE_ID_FIRST, STRIPE_ID_LAST);
+
+        reader->message = (char *)malloc(reader->count * sizeof(char));
+        if (reader->message == NULL) {
+            perror("Memory allocation error in bigBuffer");
+            exit(EXIT_FAILURE);
+        }
+        reader->messageOffset = 0;
+        reader->end = (int)partStart(reader->count, 1);
+        reader->padding = (FRAME_SIZE - reader->end%FRAME_SIZE) % FRAME_SIZE;
+
+        // Readers of other channels may wait for the buffer already:
+        struct Assembly* assembly = &assemblies[t];
+        ASSERT_ZERO(pthread_mutex_lock(&assembly->mutex));
+        assembly->id = reader->striped;
+        assembly->message = reader->message;
+        assembly->partsLeft = stripes - 1;
+        ASSERT_ZERO(pthread_cond_broadcast(&assembly->cond));
+        ASSERT_ZERO(pthread_mutex_unlock(&assembly->mutex));
+
+    // If that is a frame with many small point-to-point messages:
+    } else if (smallBuffer[FRAME_TYPE] == 'b') {
+
+        int entries = decodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST);
+        int position = 0;
+
+        for(int i = 0; i < entries; ++i) {
+            int count = decodeNumber(smallBuffer, position, position + COALESCE_COUNT_DIGITS - 1);
+            position += COALESCE_COUNT_DIGITS;
+            int context = decodeNumber(smallBuffer, position, position + COALESCE_CONTEXT_DIGITS - 1);
+            position += COALESCE_CONTEXT_DIGITS;
+            long tag = CONTEXT_TAG(context, decodeNumber(smallBuffer, position, position + COALESCE_TAG_DIGITS - 1));
+            position += COALESCE_TAG_DIGITS;
+
+            char *data = (char *)malloc(MAX(count, 1) * sizeof(char));
+            if (data == NULL) {
+                perror("Memory allocation error in data");
+                exit(EXIT_FAILURE);
             }
-            // Update result:
-            result = messBuffer[511];
+            memcpy(data, smallBuffer + position, count);
+            position += count;
+
+            deliverMessage(t, data, count, tag);
         }
 
-        // Left child:
-        if(leftChild != -1) {
-            //Update result:
-            messBuffer[511] = result;
-            //Send message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[1], messBuffer, 512);
-                if(passedInfo == 0 || passedInfo == -1) {
-                    break;
-                }
+    // If that is a deadlock probe:
+    } else if(deadlockDetection == 1 && smallBuffer[FRAME_TYPE] == 'd') {
+        handleProbe(t, smallBuffer);
+
+    // Flow control - request to send, clear to send, returned credits:
+    } else if (smallBuffer[FRAME_TYPE] == 'r') {
+        int id = decodeNumber(smallBuffer, RENDEZVOUS_ID_FIRST, RENDEZVOUS_ID_LAST);
+        long tag = decodeTag(smallBuffer);
+        int count = decodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST);
+        pushEvent(t, EVENT_RTS, NULL, count, tag, id);
+    } else if (smallBuffer[FRAME_TYPE] == 'a') {
+        grantClearance(t, decodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST));
+    } else if (smallBuffer[FRAME_TYPE] == 'c') {
+        atomic_fetch_add(&sendCredits[t], decodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST));
+    }
+}
+
+// Parses every frame contained in a batch of bytes read from the pipe.
+void readerFeed(struct FrameReader* reader, const char* batch, int size) {
+    int position = 0;
+    while (position < size) {
+
+        // Continuation of a point-to-point message:
+        if (reader->message != NULL) {
+            int chunkSize = MIN(size - position, reader->end - reader->messageOffset);
+            memcpy(reader->message + reader->messageOffset, batch + position, chunkSize);
+            reader->messageOffset += chunkSize;
+            position += chunkSize;
+            if (reader->messageOffset == reader->end) {
+                completeMessage(reader);
             }
-        }
 
-        // Right child:
-        if(rightChild != -1) {
-            // Update result:
-            messBuffer[511] = result;
-            // Send message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[2], messBuffer, 512);
-                if(passedInfo == 0 || passedInfo == -1) {
-                    break;
-                }
+        // Padding of the last frame of a point-to-point message:
+        } else if (reader->padding > 0) {
+            int chunkSize = MIN(size - position, reader->padding);
+            reader->padding -= chunkSize;
+            position += chunkSize;
 
+        // Frame with parameters:
+        } else {
+            int chunkSize = MIN(size - position, FRAME_SIZE - reader->framePosition);
+            memcpy(reader->frame + reader->framePosition, batch + position, chunkSize);
+            reader->framePosition += chunkSize;
+            position += chunkSize;
+            if (reader->framePosition == FRAME_SIZE) {
+                reader->framePosition = 0;
+                handleFrame(reader);
             }
         }
+    }
+}
 
+// Where the next read from the process goes: big remainder of a message straight into its buffer,
+// otherwise many frames at once into the batch.
+char* readTarget(struct FrameReader* reader, char* batch, int* size) {
+    if (reader->message != NULL && reader->end - reader->messageOffset >= FRAME_SIZE) {
+        *size = reader->end - reader->messageOffset;
+        return reader->message + reader->messageOffset;
     }
+    *size = READ_BATCH_SIZE;
+    return batch;
+}
 
-    // Threads:
-    for(int i = 0; i < worldSize - 1; i++) {
-        ASSERT_ZERO(pthread_join(threads[i], NULL));
+// Takes passedInfo bytes read to the target.
+void readDone(struct FrameReader* reader, char* batch, char* target, int passedInfo) {
+    if (target != batch) {
+        reader->messageOffset += passedInfo;
+        if (reader->messageOffset == reader->end) {
+            completeMessage(reader);
+        }
+        return;
     }
-    free(threads);
+    readerFeed(reader, batch, passedInfo);
+}
 
+void* messThreadFunction(void* arg) {
+    int t = *(int*)arg;
+    free(arg);
+    int readDesc = mReadDesc[t];
 
-    // Descriptors:
-    for(int i = 0; i < worldSize; ++i) {
+    int passedInfo;
 
-        if(i < 3) {
-            if(gReadDesc[i] != -1) {
-                ASSERT_SYS_OK(close(gReadDesc[i]));
-            }
-            if(gWriteDesc[i] != -1) {
-                ASSERT_SYS_OK(close(gWriteDesc[i]));
-            }
-        }
+    struct FrameReader reader = {0};
+    reader.source = t;
 
-        if(mReadDesc[i] != -1) {
-            ASSERT_SYS_OK(close(mReadDesc[i]));
-        }
-        if(mWriteDesc[i] != -1) {
-            ASSERT_SYS_OK(close(mWriteDesc[i]));
-        }
+    char* batch = (char *)malloc(READ_BATCH_SIZE * sizeof(char));
+    if (batch == NULL) {
+        perror("Memory allocation error in batch");
+        exit(EXIT_FAILURE);
+    }
 
+    // Get messages until the end of file, it means there won't be any new messages from that process:
+    while(true) {
+        int size;
+        char* target = readTarget(&reader, batch, &size);
+        passedInfo = (int)chrecv(readDesc, target, size);
+        if (passedInfo == -1 || passedInfo == 0) {
+            break;
+        }
+        readDone(&reader, batch, target, passedInfo);
     }
 
-    // Structures of descriptors:
-    free(mReadDesc);
-    free(mWriteDesc);
+    dropMessage(&reader);
+    free(batch);
 
-    free(gReadDesc);
-    free(gWriteDesc);
+    finishPeer(t);
+    return NULL;
+}
 
-    // Structure of current receiver:
-    free(currentReceiver);
-
-    // Structure of final flags:
-    free(finalFlags);
-
-    // Deadlock detection:
-    if(deadlockDetection == 1) {
-
-        // Contents of sent messages:
-        for(int i = 0; i < worldSize; ++i) {
-            struct SentMessageParameters* current = sentMessages[i];
-            while (current != NULL) {
-                struct SentMessageParameters* next = current->next;
-                free(current);
-                current = next;
-            }
+int recvAll(int desc, void* buffer, size_t size) {
+    size_t offset = 0;
+    while(offset < size) {
+        int passedInfo = (int)chrecv(desc, (char*)buffer + offset, size - offset);
+        if (passedInfo == -1 || passedInfo == 0) {
+            return -1;
         }
+        offset += passedInfo;
+    }
+    return 0;
+}
 
-        // Structure of sent messages:
-        free(sentMessages);
+// Reads parts of striped messages that come on one of the other channels from a process,
+// straight into the buffer that the reader of the main channel has allocated.
+void* stripeThreadFunction(void* arg) {
+    int index = *(int*)arg;
+    free(arg);
+    int t = index / stripes;
+    int part = index % stripes;
+    struct Assembly* assembly = &assemblies[t];
+
+    char header[FRAME_SIZE];
+    int delivered = 0;
+    while (recvAll(stripeReadDesc[index], header, FRAME_SIZE) == 0) {
+        int id = decodeNumber(header, STRIPE_ID_FIRST, STRIPE_ID_LAST);
+        int count = decodeNumber(header, FRAME_COUNT_FIRST, FRAME_COUNT_LAST);
+
+        // Header on the main channel was written before any part:
+        ASSERT_ZERO(pthread_mutex_lock(&assembly->mutex));
+        while (assembly->id != id && assembly->mainEnded == 0) {
+            ASSERT_ZERO(pthread_cond_wait(&assembly->cond, &assembly->mutex));
+        }
+        char* message = assembly->id == id ? assembly->message : NULL;
+        if (message != NULL) {
+            assembly->writers++;
+        }
+        ASSERT_ZERO(pthread_mutex_unlock(&assembly->mutex));
+        if (message == NULL) {
+            break;
+        }
 
-        // Structure of current deadlock:
-        free(currentDeadlock);
-    }
+        // Buffer is not freed while we read into it:
+        long start = partStart(count, part);
+        int result = recvAll(stripeReadDesc[index], message + start, partStart(count, part + 1) - start);
 
-    // Contents of waiting messages:
-    for(int i = 0; i < worldSize; ++i) {
-        struct WaitingMessageParameters* current = waitingMessages[i];
-        while (current != NULL) {
-            struct WaitingMessageParameters* next = current->next;
-            free(current->data);
-            free(current);
-            current = next;
+        ASSERT_ZERO(pthread_mutex_lock(&assembly->mutex));
+        assembly->writers--;
+        if (result == 0) {
+            assembly->partsLeft--;
         }
+        ASSERT_ZERO(pthread_cond_broadcast(&assembly->cond));
+        ASSERT_ZERO(pthread_mutex_unlock(&assembly->mutex));
+        if (result == -1) {
+            break;
+        }
+        delivered = id;
     }
 
-    // Structure of waiting messages:
-    free(waitingMessages);
+    // The process has finished (or died), messages after the last delivered one won't get their part:
+    ASSERT_ZERO(pthread_mutex_lock(&assembly->mutex));
+    assembly->lowestEnded = MIN(assembly->lowestEnded, delivered);
+    ASSERT_ZERO(pthread_cond_broadcast(&assembly->cond));
+    ASSERT_ZERO(pthread_mutex_unlock(&assembly->mutex));
 
-    // Contents of array of semaphores:
-    for(int i = 0; i < worldSize; ++i) {
-        sem_destroy(&arrayOfSemaphores[i]);
+    ASSERT_SYS_OK(close(stripeReadDesc[index]));
+    stripeReadDesc[index] = -1;
+    return NULL;
+}
+
+int flushCoalesced(int destination) {
+    struct CoalesceBuffer* buffer = &coalesceBuffers[destination];
+    if (buffer->entries == 0) {
+        return 0;
     }
 
-    // Structure of array of semaphores:
-    free(arrayOfSemaphores);
+    buffer->frame[FRAME_TYPE] = 'b';
+    encodeNumber(buffer->frame, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, buffer->entries);
 
-    // Receiver semaphore:
-    sem_destroy(&receiverSemaphore);
+    buffer->used = 0;
+    buffer->entries = 0;
 
-    channels_finalize();
+    return sendAll(mWriteDesc[destination], buffer->frame, FRAME_SIZE);
 }
 
-int MIMPI_World_size() {
-    return worldSize;
+// Messages may not wait in coalesce buffers while this process blocks:
+void flushAllCoalesced() {
+    if (coalesceBuffers == NULL) {
+        return;
+    }
+    for(int i = 0; i < worldSize; ++i) {
+        if (i != worldRank && finalFlags[i] == 0) {
+            lockSend(i);
+            flushCoalesced(i);
+            unlockSend(i);
+        }
+    }
 }
 
-int MIMPI_World_rank() {
-    return worldRank;
+// Flusher looks at the buffers again, one of them has just got its first entry (sending lock may be held):
+void armFlusher() {
+    ASSERT_ZERO(pthread_mutex_lock(&flusherMutex));
+    flusherArmed = 1;
+    ASSERT_ZERO(pthread_cond_signal(&flusherCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&flusherMutex));
 }
 
+// Sleeps until the oldest entry of all buffers is due, sends every buffer that is due.
+void* coalesceFlusherFunction(void* arg) {
+    (void)arg;
+
+    // Destination may exit before its buffer is sent:
+    sigset_t blocked;
+    ASSERT_SYS_OK(sigemptyset(&blocked));
+    ASSERT_SYS_OK(sigaddset(&blocked, SIGPIPE));
+    ASSERT_ZERO(pthread_sigmask(SIG_BLOCK, &blocked, NULL));
+
+    long wait = -1;     // microseconds until the oldest entry is due (-1 if all buffers are empty)
+    ASSERT_ZERO(pthread_mutex_lock(&flusherMutex));
+    while (true) {
+        if (flusherArmed == 0 && flusherStopping == 0 && wait == -1) {
+            ASSERT_ZERO(pthread_cond_wait(&flusherCond, &flusherMutex));
+        } else if (flusherArmed == 0 && flusherStopping == 0) {
+            struct timespec deadline;
+            ASSERT_SYS_OK(clock_gettime(CLOCK_REALTIME, &deadline));
+            deadline.tv_sec += wait / 1000000;
+            deadline.tv_nsec += (wait % 1000000) * 1000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            int result = pthread_cond_timedwait(&flusherCond, &flusherMutex, &deadline);
+            if (result != ETIMEDOUT) {
+                ASSERT_ZERO(result);
+            }
+        }
+        if (flusherStopping == 1) {
+            break;
+        }
+        flusherArmed = 0;
+        ASSERT_ZERO(pthread_mutex_unlock(&flusherMutex));
 
-MIMPI_Retcode MIMPI_Send(
-        void const *data,
-        int count,
-        int destination,
-        int tag
-) {
+        wait = -1;
+        for(int i = 0; i < worldSize; ++i) {
+            if (i == worldRank) {
+                continue;
+            }
+            lockSend(i);
+            if (coalesceBuffers[i].entries > 0 && finalFlags[i] == 0) {
+                long left = coalesceDelay - elapsedMicroseconds(&coalesceBuffers[i].firstEntry);
+                if (left <= 0) {
+                    flushCoalesced(i);
+                } else {
+                    wait = wait == -1 ? left : MIN(wait, left);
+                }
+            }
+            unlockSend(i);
+        }
 
-    // Exceptions:
-    if(destination == worldRank) {
-        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
-    } else if (destination < 0 || destination >= worldSize) {
-        return MIMPI_ERROR_NO_SUCH_RANK;
-    } else if (finalFlags[destination] == 1) {
-        return MIMPI_ERROR_REMOTE_FINISHED;
+        ASSERT_ZERO(pthread_mutex_lock(&flusherMutex));
     }
+    ASSERT_ZERO(pthread_mutex_unlock(&flusherMutex));
 
-    int passedInfo;
-    int remaining = count;
-    int offset = 0;
-    int chunkSize;
+    return NULL;
+}
 
-    // First message, with parameters:
+// Stops the flusher, what is left in buffers is sent by MIMPI_Finalize.
+void finalizeFlusher() {
+    ASSERT_ZERO(pthread_mutex_lock(&flusherMutex));
+    flusherStopping = 1;
+    ASSERT_ZERO(pthread_cond_signal(&flusherCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&flusherMutex));
+    ASSERT_ZERO(pthread_join(coalesceFlusher, NULL));
+    ASSERT_ZERO(pthread_mutex_destroy(&flusherMutex));
+    ASSERT_ZERO(pthread_cond_destroy(&flusherCond));
+    flusherArmed = 0;
+    flusherStopping = 0;
+}
+
+void handleEvent(int source, struct Event* event) {
+    if (event->type != EVENT_FINAL) {
+        addToWaitingMessages(source, createWaitingMessage(event->data, event->parameters.count, event->parameters.tag, event->type, event->id));
+    }
+    // Final events only wake the main thread, final flags are set by receiver threads.
+}
 
-    char smallBuffer[512] = {0};
-    smallBuffer[511] = 'm';
+// Moves all events of the source from its ring (and overflow list) to the structures of the main thread.
+void drainEvents(int source) {
+    struct EventRing* ring = &eventRings[source];
+
+    while (true) {
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            handleEvent(source, &ring->events[head % RING_SIZE]);
+            head++;
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+        }
 
-    int partsOfCount = count;
-    int partsOfTag = tag;
+        if (atomic_load(&ring->overflowCount) == 0) {
+            return;
+        }
 
-    // Encode tag:
-    for(int i = 510; i >= 501; --i) {
-        if(partsOfTag != 0) {
-            smallBuffer[i] = (char)(partsOfTag%10);
-            partsOfTag /= 10;
-        } else {
-            smallBuffer[i] = 0;
+        // Overflow list is younger than everything in the ring, the producer does not use the ring until it is empty:
+        ASSERT_ZERO(pthread_mutex_lock(&ring->overflowMutex));
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            handleEvent(source, &ring->events[head % RING_SIZE]);
+            head++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        struct Event* event = ring->overflowHead;
+        ring->overflowHead = NULL;
+        ring->overflowTail = NULL;
+        atomic_store(&ring->overflowCount, 0);
+        ASSERT_ZERO(pthread_mutex_unlock(&ring->overflowMutex));
+
+        while (event != NULL) {
+            struct Event* next = event->next;
+            handleEvent(source, event);
+            free(event);
+            event = next;
         }
     }
+}
 
-    // Encode count:
-    for(int i = 500; i >= 491; --i) {
-        if(partsOfCount != 0) {
-            smallBuffer[i] = (char)(partsOfCount%10);
-            partsOfCount /= 10;
-        } else {
-            smallBuffer[i] = 0;
+// Sleeps until the receiver thread of the source gets an event that settles the receive, returns the reason.
+// With timeout (in microseconds, 0 means no timeout) it may also return WAKE_TIMEOUT.
+int waitForEvents(int source, int count, long tag, int epoch, long timeout) {
+    struct EventRing* ring = &eventRings[source];
+
+    atomic_store_explicit(&ring->waitCount, count, memory_order_relaxed);
+    atomic_store_explicit(&ring->waitTag, tag, memory_order_relaxed);
+    atomic_store(&ring->wakeReason, WAKE_NONE);
+    ring->waitGeneration += 2;
+    unsigned int armed = ring->waitGeneration + 1;
+    atomic_store(&ring->waiter, armed);
+
+    // Events pushed (and deadlocks found) before arming were not checked by receiver threads:
+    if (ringHasEvents(source) || (epoch != 0 && atomic_load(&detectedEpoch) == epoch)) {
+        if (atomic_compare_exchange_strong(&ring->waiter, &armed, armed + 1)) {
+            return WAKE_NONE;
         }
+        // The receiver thread has already taken the wait and sets the reason.
     }
 
-    // Fill the rest of first message with content:
-    chunkSize = (remaining > 491) ? 491 : remaining;
-    memcpy(smallBuffer, data + offset, chunkSize);
+    struct timespec start;
+    ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &start));
 
-    // Send first message:
-    passedInfo = 0;
-    while(passedInfo != 512) {
-        passedInfo = (int)chsend(mWriteDesc[destination], smallBuffer, 512);
-        if (passedInfo == -1 || passedInfo == 0) {
-            return MIMPI_ERROR_REMOTE_FINISHED; // the remote process involved in communication has finished
+    int reason;
+    while ((reason = atomic_load(&ring->wakeReason)) == WAKE_NONE) {
+        if (timeout == 0) {
+            futexWait(&ring->wakeReason, WAKE_NONE, NULL);
+            continue;
         }
 
+        long left = timeout - elapsedMicroseconds(&start);
+        if (left <= 0) {
+            if (atomic_compare_exchange_strong(&ring->waiter, &armed, armed + 1)) {
+                return WAKE_TIMEOUT;
+            }
+            timeout = 0;
+            continue;
+        }
+        struct timespec relative = {left / 1000000L, (left % 1000000L) * 1000L};
+        futexWait(&ring->wakeReason, WAKE_NONE, &relative);
     }
+    return reason;
+}
 
-    remaining -= chunkSize;
-    offset += chunkSize;
-
-    // Other messages, without parameters:
-
-    while (remaining > 0) {
+int coalesceDelayPassed(struct CoalesceBuffer* buffer) {
+    return elapsedMicroseconds(&buffer->firstEntry) >= coalesceDelay;
+}
 
-        // Fill message with content:
-        chunkSize = (remaining > 512) ? 512 : remaining;
-        memcpy(smallBuffer, data + offset, chunkSize);
+static inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
 
-        // Send message:
-        passedInfo = 0;
-        while(passedInfo != 512) {
-            passedInfo = (int)chsend(mWriteDesc[destination], smallBuffer, 512);
-            if (passedInfo == -1 || passedInfo == 0) {
-                return MIMPI_ERROR_REMOTE_FINISHED;
-            }
+// Polls the ring of the source until something comes or the spin limit (counted from start) passes.
+int spinForArrival(int source, const struct timespec* start) {
+    for(int i = 1; ; ++i) {
+        if (ringHasEvents(source)) {
+            return 1;
         }
+        cpuRelax();
+        if (i % 64 == 0 && elapsedMicroseconds(start) >= spinLimit) {
+            return 0;
+        }
+    }
+}
 
-        remaining -= chunkSize;
-        offset += chunkSize;
-
+// Spin limit follows the time that spinning actually needed, it shrinks when spinning did not help.
+void tuneSpinLimit(const struct timespec* start, int hit) {
+    if (hit == 1) {
+        spinLimit += (2 * (int)elapsedMicroseconds(start) - spinLimit) / 8;
+    } else {
+        spinLimit -= spinLimit / 4;
     }
+    spinLimit = MAX(1, MIN(spinLimit, spinMax));
+}
 
-    // If deadlock detection is on, we want to add that message to sent history:
-    if (deadlockDetection == 1) {
-        sem_wait(&arrayOfSemaphores[destination]);
-        addToSentHistory(destination, count, tag);
-        sem_post(&arrayOfSemaphores[destination]);
+void printStatistics() {
+    fprintf(stderr, "MIMPI rank %d: launch to MIMPI_Init %ld us, MIMPI_Init %ld us, lazy threads %d, io_uring %d\n",
+            worldRank, startupLaunch, startupInit, lazyThreads, uringEngine);
+    fprintf(stderr, "MIMPI rank %d: receive spin hits %ld, sleeps %ld, spin limit %d us\n",
+            worldRank, recvSpinHits, recvSleeps, spinLimit);
+    if (eagerCredit > 0) {
+        fprintf(stderr, "MIMPI rank %d: eager credit %d, rendezvous sends %ld, peak unexpected bytes %ld\n",
+                worldRank, eagerCredit, rendezvousSends, unexpectedPeak);
+    }
+    if (queuedSends > 0) {
+        fprintf(stderr, "MIMPI rank %d: queued sends %ld, waits for queue space %ld\n",
+                worldRank, queuedSends, queueWaits);
+    }
+    if (stripes > 1) {
+        fprintf(stderr, "MIMPI rank %d: %d channels per process, striped sends %ld\n",
+                worldRank, stripes, stripedSends);
+    }
+    if (bulkSent + bulkReceived + bulkCollective > 0) {
+        fprintf(stderr, "MIMPI rank %d: bulk bytes sent %ld, received %ld, in collectives %ld, segment %d\n",
+                worldRank, bulkSent, bulkReceived, bulkCollective, bulkSegment);
     }
+}
 
-    return MIMPI_SUCCESS;
+// Waits until everything queued for the destination is written, queue mutex has to be held.
+void waitForQueue(int destination) {
+    while (sendQueues[destination].head != NULL || sendQueues[destination].busy == 1) {
+        ASSERT_ZERO(pthread_cond_wait(&queueCond, &queueMutex));
+    }
 }
 
-MIMPI_Retcode MIMPI_Recv(
-        void *data,
-        int count,
-        int source,
-        int tag
-) {
+// Send queues are created on first use, writers write frames in parallel with the calling threads.
+void initSendQueues() {
+    if (sendQueues != NULL) {
+        return;
+    }
+    if (sendMutexes == NULL) {
+        sendMutexes = (pthread_mutex_t *)malloc(worldSize * sizeof(pthread_mutex_t));
+        if (sendMutexes == NULL) {
+            perror("Memory allocation error in thread structures");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < worldSize; ++i) {
+            ASSERT_ZERO(pthread_mutex_init(&sendMutexes[i], NULL));
+        }
+    }
+    ASSERT_ZERO(pthread_mutex_init(&queueMutex, NULL));
+    ASSERT_ZERO(pthread_cond_init(&queueCond, NULL));
+    queuesStopping = 0;
+    sendQueues = (struct SendQueue *)calloc(worldSize, sizeof(struct SendQueue));
+    if (sendQueues == NULL) {
+        perror("Memory allocation error in sendQueues");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    // Exceptions:
-    if(source == worldRank) {
-        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
-    } else if (source < 0 || source >= worldSize) {
-        return MIMPI_ERROR_NO_SUCH_RANK;
+// Writes everything that is queued and stops writers.
+void finalizeSendQueues() {
+    if (sendQueues == NULL) {
+        return;
+    }
+    ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+    for(int i = 0; i < worldSize; ++i) {
+        waitForQueue(i);
     }
+    queuesStopping = 1;
+    ASSERT_ZERO(pthread_cond_broadcast(&queueCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
 
-    sem_wait(&arrayOfSemaphores[source]);
+    for(int i = 0; i < worldSize; ++i) {
+        if (sendQueues[i].started == 1) {
+            ASSERT_ZERO(pthread_join(sendQueues[i].writer, NULL));
+        }
+    }
+    free(sendQueues);
+    sendQueues = NULL;
+    ASSERT_ZERO(pthread_mutex_destroy(&queueMutex));
+    ASSERT_ZERO(pthread_cond_destroy(&queueCond));
+}
 
-    // Send deadlock message:
-    if (deadlockDetection == 1){
-        char messBuffer[512] = {0};
-        messBuffer[511] = 'd';
+// Waits until the data of every pending send is written (or its destination finishes), stops the payload writer.
+void finalizePayloads() {
+    if (payloadWriterStarted == 0) {
+        return;
+    }
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    payloadsStopping = 1;
+    ASSERT_ZERO(pthread_cond_broadcast(&clearanceCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+    ASSERT_ZERO(pthread_join(payloadWriter, NULL));
+    payloadWriterStarted = 0;
+    payloadsStopping = 0;
+}
 
-        // Encode tag:
-        if(tag == MIMPI_ANY_TAG) {
-            for(int i = 501; i <= 510; ++i) {
-                messBuffer[i] = (char)0;
-            }
-        } else {
-            int partsOfTag = tag;
-            for(int i = 510; i >= 501; --i) {
-                if(partsOfTag != 0) {
-                    messBuffer[i] = (char)(partsOfTag%10);
-                    partsOfTag /= 10;
-                } else {
-                    messBuffer[i] = (char)0;
-                }
-            }
+// Returns the handle of a new communicator, it takes over worldRanks.
+MIMPI_Comm createCommunicator(int size, int rank, int* worldRanks, int context) {
+    int handle = 0;
+    while (handle < communicatorCount && communicators[handle].worldRanks != NULL) {
+        handle++;
+    }
+    if (handle == communicatorCount) {
+        communicators = (struct Communicator*)realloc(communicators, (communicatorCount + 1) * sizeof(struct Communicator));
+        if (communicators == NULL) {
+            perror("Memory allocation error in communicators");
+            exit(EXIT_FAILURE);
         }
+        communicatorCount++;
+    }
+    communicators[handle].size = size;
+    communicators[handle].rank = rank;
+    communicators[handle].worldRanks = worldRanks;
+    communicators[handle].context = context;
+    communicators[handle].dimCount = 0;
+    communicators[handle].dims = NULL;
+    communicators[handle].periods = NULL;
+    communicators[handle].neighborCount = 0;
+    communicators[handle].neighbors = NULL;
+    return handle;
+}
 
-        // Encode count:
-        int partsOfCount = count;
-        for(int i = 500; i >= 491; --i) {
-            if(partsOfCount != 0) {
-                messBuffer[i] = (char)(partsOfCount%10);
-                partsOfCount /= 10;
-            } else {
-                messBuffer[i] = (char)0;
-            }
+// Returns the handle of a new datatype, it takes over blocks.
+MIMPI_Datatype createDatatype(struct TypeBlock* blocks, int blockCount, long extent) {
+    int handle = 0;
+    while (handle < datatypeCount && datatypes[handle].blocks != NULL) {
+        handle++;
+    }
+    if (handle == datatypeCount) {
+        datatypes = (struct Datatype*)realloc(datatypes, (datatypeCount + 1) * sizeof(struct Datatype));
+        if (datatypes == NULL) {
+            perror("Memory allocation error in datatypes");
+            exit(EXIT_FAILURE);
         }
+        datatypeCount++;
+    }
+    datatypes[handle].blocks = blocks;
+    datatypes[handle].blockCount = blockCount;
+    datatypes[handle].size = 0;
+    for(int i = 0; i < blockCount; ++i) {
+        datatypes[handle].size += blocks[i].length;
+    }
+    datatypes[handle].extent = extent;
+    datatypes[handle].committed = 0;
+    datatypes[handle].stride = 0;
+    return handle;
+}
 
-        int passedInfo = 0;
-        while (passedInfo != 512) {
-            passedInfo = (int)chsend(mWriteDesc[source], messBuffer, 512);
-            if (passedInfo == -1 || passedInfo == 0) {
-                return MIMPI_ERROR_REMOTE_FINISHED;
-            }
-        }
+// Returns the handle of a committed type of size contiguous bytes.
+MIMPI_Datatype createBasicDatatype(int size) {
+    struct TypeBlock* block = (struct TypeBlock*)malloc(sizeof(struct TypeBlock));
+    if (block == NULL) {
+        perror("Memory allocation error in block");
+        exit(EXIT_FAILURE);
+    }
+    block->offset = 0;
+    block->length = size;
+    MIMPI_Datatype handle = createDatatype(block, 1, size);
+    datatypes[handle].committed = 1;
+    return handle;
+}
 
+// Maps the rings of a new io_uring instance, returns -1 if the kernel does not provide it or reads through it.
+int setupUring(struct Uring* u, unsigned size) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    u->desc = (int)syscall(__NR_io_uring_setup, size, &params);
+    if (u->desc == -1) {
+        return -1;
     }
 
-    // Find the message in waiting messages:
-    struct WaitingMessageParameters* current = waitingMessages[source];
-    struct WaitingMessageParameters* previous = NULL;
-    while (current != NULL) {
-        // If we have a match:
-        if (current->parameters.count == count && (current->parameters.tag == tag || tag == MIMPI_ANY_TAG)) {
+    // Reads need IORING_OP_READ (older kernels do not have it or the probe, the thread engine is used then):
+    size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probeSize);
+    if (probe == NULL) {
+        perror("Memory allocation error in probe");
+        exit(EXIT_FAILURE);
+    }
+    int supported = syscall(__NR_io_uring_register, u->desc, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+                    probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        ASSERT_SYS_OK(close(u->desc));
+        return -1;
+    }
 
-            if (previous == NULL) {
-                // If the node to be deleted is the head:
-                waitingMessages[source] = current->next;
-            } else {
-                // If the node to be deleted is not the head:
-                previous->next = current->next;
-            }
+    u->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        u->submissionRingSize = MAX(u->submissionRingSize, u->completionRingSize);
+    }
+    u->submissionRing = mmap(NULL, u->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->desc, IORING_OFF_SQ_RING);
+    if (u->submissionRing == MAP_FAILED) {
+        ASSERT_SYS_OK(close(u->desc));
+        return -1;
+    }
+    u->completionRing = u->submissionRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->completionRing = mmap(NULL, u->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->desc, IORING_OFF_CQ_RING);
+        if (u->completionRing == MAP_FAILED) {
+            ASSERT_SYS_OK(munmap(u->submissionRing, u->submissionRingSize));
+            ASSERT_SYS_OK(close(u->desc));
+            return -1;
+        }
+    }
+    u->entriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->entries = mmap(NULL, u->entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->desc, IORING_OFF_SQES);
+    if (u->entries == MAP_FAILED) {
+        if (u->completionRing != u->submissionRing) {
+            ASSERT_SYS_OK(munmap(u->completionRing, u->completionRingSize));
+        }
+        ASSERT_SYS_OK(munmap(u->submissionRing, u->submissionRingSize));
+        ASSERT_SYS_OK(close(u->desc));
+        return -1;
+    }
+
+    u->submissionTail = (unsigned*)((char*)u->submissionRing + params.sq_off.tail);
+    u->submissionMask = (unsigned*)((char*)u->submissionRing + params.sq_off.ring_mask);
+    u->submissionArray = (unsigned*)((char*)u->submissionRing + params.sq_off.array);
+    u->completionHead = (unsigned*)((char*)u->completionRing + params.cq_off.head);
+    u->completionTail = (unsigned*)((char*)u->completionRing + params.cq_off.tail);
+    u->completionMask = (unsigned*)((char*)u->completionRing + params.cq_off.ring_mask);
+    u->completions = (struct io_uring_cqe*)((char*)u->completionRing + params.cq_off.cqes);
+    return 0;
+}
 
-            memcpy(data, current->data, count);
+void freeUring(struct Uring* u) {
+    ASSERT_SYS_OK(munmap(u->entries, u->entriesSize));
+    if (u->completionRing != u->submissionRing) {
+        ASSERT_SYS_OK(munmap(u->completionRing, u->completionRingSize));
+    }
+    ASSERT_SYS_OK(munmap(u->submissionRing, u->submissionRingSize));
+    ASSERT_SYS_OK(close(u->desc));
+}
 
-            free(current->data);
-            free(current);
+// Queues a read from the process, it is submitted with the next io_uring_enter.
+void postRead(struct Uring* u, int source, char* target, int size) {
+    unsigned tail = *u->submissionTail;
+    unsigned index = tail & *u->submissionMask;
+    struct io_uring_sqe* entry = &u->entries[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->opcode = IORING_OP_READ;
+    entry->fd = mReadDesc[source];
+    entry->addr = (unsigned long)target;
+    entry->len = size;
+    entry->off = (__u64)-1;
+    entry->user_data = source;
+    u->submissionArray[index] = index;
+    atomic_store_explicit((atomic_uint*)u->submissionTail, tail + 1, memory_order_release);
+}
 
-            sem_post(&arrayOfSemaphores[source]);
-            return MIMPI_SUCCESS;
+// Progress engine: a read is posted for every process all the time, completions are parsed by this thread.
+// All reads that were taken are posted again with one system call, which also waits for the next completion.
+// The engine never writes: probes, credits and clearances it answers with go to the control writer,
+// a full pipe to one process cannot stop the reads from all the others.
+void* uringThreadFunction(void* arg) {
+    (void)arg;
+
+    struct FrameReader* readers = (struct FrameReader *)calloc(worldSize, sizeof(struct FrameReader));
+    char* batches = (char *)malloc((size_t)worldSize * READ_BATCH_SIZE * sizeof(char));
+    char** targets = (char **)malloc(worldSize * sizeof(char*));
+    if (readers == NULL || batches == NULL || targets == NULL) {
+        perror("Memory allocation error in progress engine");
+        exit(EXIT_FAILURE);
+    }
+
+    int posted = 0;
+    for(int i = 0; i < worldSize; ++i) {
+        if (i != worldRank) {
+            readers[i].source = i;
+            int size;
+            targets[i] = readTarget(&readers[i], batches + (size_t)i * READ_BATCH_SIZE, &size);
+            postRead(&uring, i, targets[i], size);
+            posted++;
         }
-        previous = current;
-        current = current->next;
     }
 
-    // If the message is not on the list of waiting messages:
+    // Get messages until the end of file from every process:
+    int active = worldSize - 1;
+    while (active > 0) {
+        int result = (int)syscall(__NR_io_uring_enter, uring.desc, posted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result == -1 && errno != EINTR) {
+            syserr("io_uring_enter failed");
+        }
+        posted -= result == -1 ? 0 : result;
+
+        unsigned head = *uring.completionHead;
+        unsigned tail = atomic_load_explicit((atomic_uint*)uring.completionTail, memory_order_acquire);
+        for(; head != tail; ++head) {
+            struct io_uring_cqe* completion = &uring.completions[head & *uring.completionMask];
+            int t = (int)completion->user_data;
+            int passedInfo = completion->res;
+            char* batch = batches + (size_t)t * READ_BATCH_SIZE;
+
+            // Interrupted read is posted again:
+            if (passedInfo == -EINTR || passedInfo == -EAGAIN) {
+                int size;
+                targets[t] = readTarget(&readers[t], batch, &size);
+                postRead(&uring, t, targets[t], size);
+                posted++;
+                continue;
+            }
 
-    // Final case:
-    if(finalFlags[source] == 1) {
-        sem_post(&arrayOfSemaphores[source]);
-        return MIMPI_ERROR_REMOTE_FINISHED;
-    // Deadlock case:
-    } else if(deadlockDetection == 1 && (currentDeadlock[source].count != -1 || currentDeadlock[source].tag != -1)) {
-        if(findMatchingPair(source) == 0) {
-            currentDeadlock[source].count = -1;
-            currentDeadlock[source].tag = -1;
-            sem_post(&arrayOfSemaphores[source]);
-            return MIMPI_ERROR_DEADLOCK_DETECTED;
+            // Only the end of file means that the process has finished (every read it needs is supported):
+            if (passedInfo < 0) {
+                errno = -passedInfo;
+                syserr("io_uring read failed");
+            }
+            if (passedInfo == 0) {
+                dropMessage(&readers[t]);
+                finishPeer(t);
+                active--;
+                continue;
+            }
+            readDone(&readers[t], batch, targets[t], passedInfo);
+
+            int size;
+            targets[t] = readTarget(&readers[t], batch, &size);
+            postRead(&uring, t, targets[t], size);
+            posted++;
         }
+        atomic_store_explicit((atomic_uint*)uring.completionHead, head, memory_order_release);
     }
 
-    // Wait for the message to appear:
-    currentReceiver[source].count = count;
-    currentReceiver[source].tag = tag;
-
-    sem_post(&arrayOfSemaphores[source]);
-    sem_wait(&receiverSemaphore);
+    free(readers);
+    free(batches);
+    free(targets);
+    return NULL;
+}
 
-    currentReceiver[source].count = -1;
-    currentReceiver[source].tag = -1;
+// Starts the thread that reads messages from the source (once, threads may be created lazily).
+void startReceiver(int source) {
+    if (threadStarted[source] == 1) {
+        return;
+    }
+    ASSERT_ZERO(pthread_mutex_lock(&threadsMutex));
+    if (threadStarted[source] == 0) {
+        int* worker_arg = malloc(sizeof(int));
+        if (worker_arg == NULL) {
+            perror("Memory allocation error in worker_arg");
+            exit(EXIT_FAILURE);
+        }
+        *worker_arg = source;
+        int t = source < worldRank ? source : source-1;
+        if (uringEngine == 0) {
+            ASSERT_ZERO(pthread_create(&threads[t], NULL, messThreadFunction, worker_arg));
+        } else {
+            free(worker_arg);
+        }
 
-    // Final case:
-    if(finalFlags[source] == 1) {
-        sem_post(&arrayOfSemaphores[source]);
-        return MIMPI_ERROR_REMOTE_FINISHED;
-    // Deadlock case:
-    } else if(deadlockDetection == 1 && (currentDeadlock[source].count != -1 || currentDeadlock[source].tag != -1)) {
-        currentDeadlock[source].count = -1;
-        currentDeadlock[source].tag = -1;
-        sem_post(&arrayOfSemaphores[source]);
-        return MIMPI_ERROR_DEADLOCK_DETECTED;
-    }
-
-    // Take the message from the end of the list of waiting messages:
-    if (waitingMessages[source]->next == NULL) {
-        memcpy(data, waitingMessages[source]->data, count);
-        free(waitingMessages[source]->data);
-        free(waitingMessages[source]);
-        waitingMessages[source] = NULL;
-    } else {
-        current = waitingMessages[source];
-        while (current->next->next != NULL) {
-            current = current->next;
+        // Readers of other channels, with their part of striped messages:
+        for(int i = 1; i < stripes; ++i) {
+            int* stripe_arg = malloc(sizeof(int));
+            if (stripe_arg == NULL) {
+                perror("Memory allocation error in stripe_arg");
+                exit(EXIT_FAILURE);
+            }
+            *stripe_arg = source * stripes + i;
+            ASSERT_ZERO(pthread_create(&stripeThreads[source * stripes + i], NULL, stripeThreadFunction, stripe_arg));
         }
-        memcpy(data, current->next->data, count);
-        free(current->next->data);
-        free(current->next);
-        current->next = NULL;
+        threadStarted[source] = 1;
     }
+    ASSERT_ZERO(pthread_mutex_unlock(&threadsMutex));
+}
 
-    sem_post(&arrayOfSemaphores[source]);
-    return MIMPI_SUCCESS;
+void MIMPI_Init_thread(bool enable_deadlock_detection, int required, int* provided) {
+    threadLevel = MAX(MIMPI_THREAD_SINGLE, MIN(required, MIMPI_THREAD_MULTIPLE));
+    if (provided != NULL) {
+        *provided = threadLevel;
+    }
+    MIMPI_Init(enable_deadlock_detection);
 }
 
-MIMPI_Retcode MIMPI_Barrier() { // (2log_2)
+void MIMPI_Init(bool enable_deadlock_detection) {
+    struct timespec initStart;
+    ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &initStart));
 
-    char messBuffer[512] = {0};
-    char result = 'g';
+    channels_init();
 
-    int passedInfo;
+    // Time of the spawn (CLOCK_MONOTONIC microseconds), set by mimpirun:
+    char *envLaunch = getenv("MIMPI_ENV_LAUNCH_USEC");
+    if (envLaunch != NULL) {
+        long launch = strtol(envLaunch, NULL, 10);
+        startupLaunch = initStart.tv_sec * 1000000L + initStart.tv_nsec / 1000L - launch;
+        unsetenv("MIMPI_ENV_LAUNCH_USEC");
+    }
 
-    // Left child:
-    if(leftChild != -1) {
-        // Get message:
-        passedInfo = 0;
-        while(passedInfo != 512) {
-            passedInfo = (int)chrecv(gReadDesc[1], messBuffer, 512);
-        }
-        // Update result:
-        if(messBuffer[511] != 'g') {
-            result = 'd';
-        }
-        messBuffer[511] = 0;
+    // Envirinment variable - worldSize:
+    char *envWorldSize = getenv("MIMPI_ENV_WORLD_SIZE");
+    if (envWorldSize == NULL) {
+        perror("Environment variable error in MIMPI_ENV_WORLD_SIZE");
+        exit(EXIT_FAILURE);
+    }
+    worldSize = (int)strtol(envWorldSize, NULL, 10);
+    if (unsetenv("MIMPI_ENV_WORLD_SIZE") != 0) {
+        fprintf(stderr, "Unsetting env variable MIMPI_ENV_WORLD_SIZE failed\n");
+        exit(EXIT_FAILURE);
     }
 
-    // Right child:
-    if(rightChild != -1) {
-        // Get message:
+    // Envirinment variable - worldRank:
+    char *envWorldRank = getenv("MIMPI_ENV_WORLD_RANK");
+    if (envWorldRank == NULL) {
+        perror("Environment variable error in MIMPI_ENV_WORLD_RANK");
+        exit(EXIT_FAILURE);
+    }
+    worldRank = (int)strtol(envWorldRank, NULL, 10);
+    if (unsetenv("MIMPI_ENV_WORLD_RANK") != 0) {
+        fprintf(stderr, "Unsetting env variable MIMPI_ENV_WORLD_RANK failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Find node relations:
+    findNodeRelations();
+
+    // Waiting messages structure:
+    waitingMessages = (struct WaitingMessageParameters**)malloc(worldSize * sizeof(struct WaitingMessageParameters*));
+    if (waitingMessages == NULL) {
+        perror("Memory allocation error in waitingMessages");
+        exit(EXIT_FAILURE);
+    }
+
+    // Final flags structure:
+    finalFlags = (atomic_int *)malloc(worldSize * sizeof(atomic_int));
+    if (finalFlags == NULL) {
+        perror("Memory allocation error in finalFlags");
+        exit(EXIT_FAILURE);
+    }
+
+    // Event rings structure:
+    eventRings = (struct EventRing*)aligned_alloc(CACHE_LINE_SIZE, worldSize * sizeof(struct EventRing));
+    if (eventRings == NULL) {
+        perror("Memory allocation error in eventRings");
+        exit(EXIT_FAILURE);
+    }
+
+    // Spin-then-sleep wait in MIMPI_Recv (off by default):
+    spinMax = MAX(getEnvInt("MIMPI_SPIN_USEC", 0), 0);
+    spinLimit = spinMax;
+
+    // Initializations:
+    for(int i = 0; i < worldSize; ++i) {
+        waitingMessages[i] = NULL;
+
+        atomic_init(&finalFlags[i], 0);
+
+        atomic_init(&eventRings[i].head, 0);
+        atomic_init(&eventRings[i].tail, 0);
+        atomic_init(&eventRings[i].overflowCount, 0);
+        ASSERT_ZERO(pthread_mutex_init(&eventRings[i].overflowMutex, NULL));
+        eventRings[i].overflowHead = NULL;
+        eventRings[i].overflowTail = NULL;
+        atomic_init(&eventRings[i].waiter, 0);
+        atomic_init(&eventRings[i].waitCount, -1);
+        atomic_init(&eventRings[i].waitTag, -1);
+        atomic_init(&eventRings[i].wakeReason, WAKE_NONE);
+        eventRings[i].waitGeneration = 0;
+    }
+
+    // Structures for many application threads:
+    if (threadLevel == MIMPI_THREAD_MULTIPLE) {
+        postedReceives = (struct PostedReceive **)calloc(worldSize, sizeof(struct PostedReceive *));
+        peerMutexes = (pthread_mutex_t *)malloc(worldSize * sizeof(pthread_mutex_t));
+        if (postedReceives == NULL || peerMutexes == NULL) {
+            perror("Memory allocation error in thread structures");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < worldSize; ++i) {
+            ASSERT_ZERO(pthread_mutex_init(&peerMutexes[i], NULL));
+        }
+    }
+
+    // Receiver threads write deadlock probes and close channels of finished processes too:
+    sendMutexes = (pthread_mutex_t *)malloc(worldSize * sizeof(pthread_mutex_t));
+    if (sendMutexes == NULL) {
+        perror("Memory allocation error in thread structures");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < worldSize; ++i) {
+        ASSERT_ZERO(pthread_mutex_init(&sendMutexes[i], NULL));
+    }
+
+    // Segment for shared-memory collectives:
+    char *envSharedBytes = getenv("MIMPI_ENV_SHM_BYTES");
+    if (envSharedBytes != NULL) {
+        sharedSize = (size_t)strtol(envSharedBytes, NULL, 10);
+        unsetenv("MIMPI_ENV_SHM_BYTES");
+    }
+    if (sharedSize > 0 && sharedSize < sizeof(struct SharedControl) + MAX(FRAME_SIZE, worldSize * CACHE_LINE_SIZE)) {
+
+        // Segment without room for a frame or a reduce slot of every process, collectives go through pipes:
+        ASSERT_SYS_OK(close(SHARED_DESC));
+        sharedSize = 0;
+    } else if (sharedSize > 0) {
+        void* segment = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED, SHARED_DESC, 0);
+        if (segment == MAP_FAILED) {
+            perror("Mapping of the shared segment failed");
+            exit(EXIT_FAILURE);
+        }
+        ASSERT_SYS_OK(close(SHARED_DESC));
+        sharedControl = (struct SharedControl*)segment;
+        sharedData = (uint8_t*)segment + sizeof(struct SharedControl);
+        sharedBytes = (int)(sharedSize - sizeof(struct SharedControl));
+    }
+
+    // Communicator of all processes:
+    int* worldRanks = (int *)malloc(worldSize * sizeof(int));
+    if (worldRanks == NULL) {
+        perror("Memory allocation error in worldRanks");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < worldSize; ++i) {
+        worldRanks[i] = i;
+    }
+    createCommunicator(worldSize, worldRank, worldRanks, 0);
+
+    // Predefined datatypes, in the order of their handles:
+    createBasicDatatype(1);
+    createBasicDatatype(sizeof(int));
+    createBasicDatatype(sizeof(double));
+
+    // Coalescing of small messages (off by default):
+    coalesceBytes = MIN(getEnvInt("MIMPI_COALESCE_BYTES", 0), FIRST_PAYLOAD_SIZE);
+    coalesceDelay = getEnvInt("MIMPI_COALESCE_USEC", 1000);
+
+    // Transfers with size_t counts go in messages of this size (256 MiB by default):
+    bulkSegment = MAX(getEnvInt("MIMPI_BULK_SEGMENT_BYTES", 1 << 28), FRAME_SIZE);
+    if (coalesceBytes > 0) {
+        coalesceBuffers = (struct CoalesceBuffer *)calloc(worldSize, sizeof(struct CoalesceBuffer));
+        if (coalesceBuffers == NULL) {
+            perror("Memory allocation error in coalesceBuffers");
+            exit(EXIT_FAILURE);
+        }
+        ASSERT_ZERO(pthread_mutex_init(&flusherMutex, NULL));
+        ASSERT_ZERO(pthread_cond_init(&flusherCond, NULL));
+        ASSERT_ZERO(pthread_create(&coalesceFlusher, NULL, coalesceFlusherFunction, NULL));
+    }
+
+    // Send queue for MIMPI_Send (off by default):
+    queueBudget = getEnvInt("MIMPI_SEND_QUEUE_BYTES", 0);
+    if (queueBudget > 0) {
+        initSendQueues();
+    }
+
+    // Flow control (off by default), a cap of unexpected bytes is split evenly between processes:
+    eagerCredit = getEnvInt("MIMPI_EAGER_BYTES", 0);
+    int unexpectedCap = getEnvInt("MIMPI_UNEXPECTED_BYTES", 0);
+    if (unexpectedCap > 0 && worldSize > 1) {
+        int share = MAX(unexpectedCap / (worldSize - 1), 1);
+        eagerCredit = eagerCredit > 0 ? MIN(eagerCredit, share) : share;
+    }
+    if (eagerCredit > 0) {
+        sendCredits = (atomic_long *)malloc(worldSize * sizeof(atomic_long));
+        returnedCredits = (long *)calloc(worldSize, sizeof(long));
+        rendezvousIds = (int *)calloc(worldSize, sizeof(int));
+        clearances = (struct Clearance **)calloc(worldSize, sizeof(struct Clearance *));
+        if (sendCredits == NULL || returnedCredits == NULL || rendezvousIds == NULL || clearances == NULL) {
+            perror("Memory allocation error in flow control");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < worldSize; ++i) {
+            atomic_init(&sendCredits[i], eagerCredit);
+        }
+        ASSERT_ZERO(pthread_mutex_init(&clearanceMutex, NULL));
+        ASSERT_ZERO(pthread_cond_init(&clearanceCond, NULL));
+    }
+
+    // Deadlock detection (off with MIMPI_THREAD_MULTIPLE, a blocked thread does not stop others from sending):
+    if (enable_deadlock_detection == true && threadLevel != MIMPI_THREAD_MULTIPLE) {
+
+        // Deadlock detection flag:
+        deadlockDetection = 1;
+
+        // Grace period of a blocked receive before the detector looks at it:
+        deadlockGrace = MAX(getEnvInt("MIMPI_DEADLOCK_GRACE_USEC", 10000), 1);
+
+        // Counters structures:
+        sentCounters = (struct MessageCounter**)calloc(COUNTER_BUCKETS, sizeof(struct MessageCounter*));
+        receivedCounters = (struct MessageCounter**)calloc(COUNTER_BUCKETS, sizeof(struct MessageCounter*));
+        probeSenders = (int*)malloc(worldSize * sizeof(int));
+        probeEpochs = (int*)malloc(worldSize * sizeof(int));
+        if (sentCounters == NULL || receivedCounters == NULL || probeSenders == NULL || probeEpochs == NULL) {
+            perror("Memory allocation error in counters");
+            exit(EXIT_FAILURE);
+        }
+        for(int i = 0; i < worldSize; ++i) {
+            probeSenders[i] = -1;
+            probeEpochs[i] = 0;
+        }
+        ASSERT_ZERO(pthread_mutex_init(&detectorMutex, NULL));
+        blockedOn = -1;
+        blockedEpoch = 0;
+        atomic_store(&detectedEpoch, 0);
+    }
+
+    // Point-to-point message descriptors structure:
+    mReadDesc = (int *)malloc(worldSize * sizeof(int));
+    if (mReadDesc == NULL) {
+        perror("Memory allocation error in mReadDesc");
+        exit(EXIT_FAILURE);
+    }
+    mWriteDesc = (int *)malloc(worldSize * sizeof(int));
+    if (mWriteDesc == NULL) {
+        perror("Memory allocation error in mWriteDesc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Group message descriptors structure:
+    gReadDesc = (int *)malloc(3 * sizeof(int)); //(0 = góra , 1 = dół/lewo , 2 = dół/prawo)
+    if (gReadDesc == NULL) {
+        perror("Memory allocation error in gReadDesc");
+        exit(EXIT_FAILURE);
+    }
+    gWriteDesc = (int *)malloc(3 * sizeof(int)); //(0 = góra , 1 = dół/lewo , 2 = dół/prawo)
+    if (gWriteDesc == NULL) {
+        perror("Memory allocation error in gWriteDesc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Places for group descriptors that are not used:
+    if(parentNode == -1) {
+        gReadDesc[0] = -1;
+        gWriteDesc[0] = -1;
+    }
+
+    if(leftChild == -1) {
+        gReadDesc[1] = -1;
+        gWriteDesc[1] = -1;
+    }
+
+    if(rightChild == -1) {
+        gReadDesc[2] = -1;
+        gWriteDesc[2] = -1;
+    }
+
+    int mReadDescInd = 0;
+    int mWriteDescInd = 0;
+    int k = 0;
+    for(int j = 0; j < worldSize*(worldSize-1) + 2*(worldSize-1); ++j) {
+        if(j != k && j%(worldSize-1) == 0 && k < worldSize) {
+            k++;
+        }
+
+        // Places for point-to-point descriptors that are not used:
+
+        if(mReadDescInd == worldRank) {
+            mReadDesc[mReadDescInd] = -1;
+            mReadDescInd++;
+        }
+        if(mWriteDescInd == worldRank) {
+            mWriteDesc[mWriteDescInd] = -1;
+            mWriteDescInd++;
+        }
+
+            // Descriptors for point-to-point messages:
+
+        if(worldRank*(worldSize-1) <= j && j < (worldRank+1)*(worldSize-1)) {
+            mReadDesc[mReadDescInd] = DESC_SHIFT + j*2 ;
+            mReadDescInd++;
+        } else if(j < worldRank*(worldSize-1) && j == k*(worldSize-1)+worldRank-1) {
+            mWriteDesc[mWriteDescInd] = DESC_SHIFT + j*2 + 1;
+            mWriteDescInd++;
+        } else if((worldRank+1)*(worldSize-1) <= j && j < worldSize*(worldSize-1) && j == k*(worldSize-1)+worldRank) {
+            mWriteDesc[mWriteDescInd] = DESC_SHIFT + j*2 + 1;
+            mWriteDescInd++;
+
+            // Descriptors for group messages:
+
+        } else if (j == worldSize*(worldSize-1) + 2*(worldRank-1) && parentNode != -1) {
+            gReadDesc[0] = DESC_SHIFT + j*2;
+        } else if (j == worldSize*(worldSize-1) + 2*(worldRank-1) + 1 && parentNode != -1) {
+            gWriteDesc[0] = DESC_SHIFT + j*2 + 1;
+        } else if (j == worldSize*(worldSize-1) + 4*worldRank && leftChild != -1) {
+            gWriteDesc[1] = DESC_SHIFT + j*2 + 1;
+        } else if (j == worldSize*(worldSize-1) + 4*worldRank + 1 && leftChild != -1) {
+            gReadDesc[1] = DESC_SHIFT + j*2;
+        } else if (j == worldSize*(worldSize-1) + 4*worldRank+2 && rightChild != -1) {
+            gWriteDesc[2] = DESC_SHIFT + j*2 + 1;
+        } else if (j == worldSize*(worldSize-1) + 4*worldRank+2 + 1 && rightChild != -1) {
+            gReadDesc[2] = DESC_SHIFT + j*2;
+        }
+    }
+
+    // Other channels for striping, stripes-1 for every pair of processes after the main and group channels:
+    stripes = MAX(getEnvInt("MIMPI_ENV_STRIPES", 1), 1);
+    stripeBytes = MAX(getEnvInt("MIMPI_STRIPE_BYTES", 1 << 20), stripes * FRAME_SIZE);
+    if (stripes > 1) {
+        stripeReadDesc = (int *)malloc(worldSize * stripes * sizeof(int));
+        stripeWriteDesc = (int *)malloc(worldSize * stripes * sizeof(int));
+        stripeThreads = (pthread_t *)malloc(worldSize * stripes * sizeof(pthread_t));
+        stripeIds = (int *)calloc(worldSize, sizeof(int));
+        assemblies = (struct Assembly *)calloc(worldSize, sizeof(struct Assembly));
+        if (stripeReadDesc == NULL || stripeWriteDesc == NULL || stripeThreads == NULL || stripeIds == NULL || assemblies == NULL) {
+            perror("Memory allocation error in stripes");
+            exit(EXIT_FAILURE);
+        }
+        int first = worldSize*(worldSize-1) + 2*(worldSize-1);
+        for(int i = 0; i < worldSize; ++i) {
+            ASSERT_ZERO(pthread_mutex_init(&assemblies[i].mutex, NULL));
+            ASSERT_ZERO(pthread_cond_init(&assemblies[i].cond, NULL));
+            assemblies[i].lowestEnded = INT_MAX;
+            for(int j = 0; j < stripes; ++j) {
+                stripeReadDesc[i * stripes + j] = -1;
+                stripeWriteDesc[i * stripes + j] = -1;
+            }
+            if (i == worldRank) {
+                continue;
+            }
+            int fromPeer = i * (worldSize - 1) + (worldRank < i ? worldRank : worldRank - 1);
+            int toPeer = worldRank * (worldSize - 1) + (i < worldRank ? i : i - 1);
+            for(int j = 1; j < stripes; ++j) {
+                stripeReadDesc[i * stripes + j] = DESC_SHIFT + (first + fromPeer * (stripes - 1) + j - 1) * 2;
+                stripeWriteDesc[i * stripes + j] = DESC_SHIFT + (first + toPeer * (stripes - 1) + j - 1) * 2 + 1;
+            }
+        }
+    }
+
+    // Threads:
+    threads = (pthread_t *)malloc((worldSize-1) * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("Memory allocation error in threads");
+        exit(EXIT_FAILURE);
+    }
+
+    threadStarted = (atomic_int *)malloc(worldSize * sizeof(atomic_int));
+    if (threadStarted == NULL) {
+        perror("Memory allocation error in threadStarted");
+        exit(EXIT_FAILURE);
+    }
+    for(int i = 0; i < worldSize; ++i) {
+        threadStarted[i] = 0;
+    }
+    ASSERT_ZERO(pthread_mutex_init(&threadsMutex, NULL));
+    ASSERT_ZERO(pthread_mutex_init(&controlMutex, NULL));
+    ASSERT_ZERO(pthread_cond_init(&controlCond, NULL));
+
+    // One thread reads from all processes with io_uring if it is asked for and the kernel provides it,
+    // otherwise every process gets its own thread:
+    if (getEnvInt("MIMPI_URING", 0) == 1 && worldSize > 1 && setupUring(&uring, 2 * worldSize) == 0) {
+        uringEngine = 1;
+        ASSERT_ZERO(pthread_create(&uringThread, NULL, uringThreadFunction, NULL));
+    }
+
+    // Probes may come from any process, so deadlock detection needs all threads from the start:
+    lazyThreads = (getEnvInt("MIMPI_LAZY_THREADS", 0) == 1 && deadlockDetection == 0 && uringEngine == 0) ? 1 : 0;
+    if (lazyThreads == 0) {
+        for(int i = 0; i < worldSize; ++i) {
+            if (i != worldRank) {
+                startReceiver(i);
+            }
+        }
+    }
+
+    startupInit = elapsedMicroseconds(&initStart);
+}
+
+void MIMPI_Finalize() {
+
+    // Threads that were not needed yet have to read what is left in the pipes (peers may wait on them):
+    for(int i = 0; i < worldSize; ++i) {
+        if (i != worldRank) {
+            startReceiver(i);
+        }
+    }
+
+    finalizeSendQueues();
+    finalizePayloads();
+    if (coalesceBuffers != NULL) {
+        finalizeFlusher();
+    }
+    flushAllCoalesced();
+    waitForControl();
+
+    // Shared collectives that wait for us fail from now on:
+    if (sharedControl != NULL) {
+        atomic_fetch_or(&sharedControl->generation, SHARED_FINISHED);
+        futexWakeShared(&sharedControl->generation);
+    }
+
+    // Closing our channels tells every other process that we execute finalize (it reads the end of file):
+    for(int i = 0; i< worldSize; ++i) {
+        if(i == worldRank) {
+            continue;
+        }
+        lockSend(i);
+        if (mWriteDesc[i] != -1) {
+            ASSERT_SYS_OK(close(mWriteDesc[i]));
+            mWriteDesc[i] = -1;
+        }
+        for(int j = 1; j < stripes; ++j) {
+            ASSERT_SYS_OK(close(stripeWriteDesc[i * stripes + j]));
+        }
+        unlockSend(i);
+    }
+
+    int passedInfo;
+    char messBuffer[512] = {0};
+
+    char result = 'd';
+    while(result != 'f') {
+        result = 'f';
+
+        // Left child:
+        if(leftChild != -1) {
+            // Get message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[1], messBuffer, 512);
+                if(passedInfo == 0 || passedInfo == -1) {
+                    messBuffer[511] = 'f';
+                    break;
+                }
+            }
+            // Update result:
+            if(messBuffer[511] != 'f') {
+                result = 'd';
+            }
+            messBuffer[511] = 0;
+        }
+
+        // Right child:
+        if(rightChild != -1) {
+            // Get message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[2], messBuffer, 512);
+                if(passedInfo == 0 || passedInfo == -1) {
+                    messBuffer[511] = 'f';
+                    break;
+                }
+            }
+            // Update result:
+            if(messBuffer[511] != 'f') {
+                result = 'd';
+            }
+            messBuffer[511] = 0;
+
+        }
+
+        // Parent:
+        if(parentNode != -1) {
+            // Update result:
+            messBuffer[511] = result;
+            // Send message:
+            passedInfo = 0;
+            while (passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[0], messBuffer, 512);
+                if(passedInfo == 0 || passedInfo == -1) {
+                    messBuffer[511] = 'f';
+                    break;
+                }
+            }
+            // Get message:
+            passedInfo = 0;
+            while (passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[0], messBuffer, 512);
+                if(passedInfo == 0 || passedInfo == -1) {
+                    messBuffer[511] = 'f';
+                    break;
+                }
+            }
+            // Update result:
+            result = messBuffer[511];
+        }
+
+        // Left child:
+        if(leftChild != -1) {
+            //Update result:
+            messBuffer[511] = result;
+            //Send message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[1], messBuffer, 512);
+                if(passedInfo == 0 || passedInfo == -1) {
+                    break;
+                }
+            }
+        }
+
+        // Right child:
+        if(rightChild != -1) {
+            // Update result:
+            messBuffer[511] = result;
+            // Send message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[2], messBuffer, 512);
+                if(passedInfo == 0 || passedInfo == -1) {
+                    break;
+                }
+
+            }
+        }
+
+    }
+
+    // Threads:
+    if (uringEngine == 1) {
+        ASSERT_ZERO(pthread_join(uringThread, NULL));
+        freeUring(&uring);
+    } else {
+        for(int i = 0; i < worldSize - 1; i++) {
+            ASSERT_ZERO(pthread_join(threads[i], NULL));
+        }
+    }
+    free(threads);
+    for(int i = 0; i < worldSize; ++i) {
+        for(int j = 1; j < stripes && i != worldRank; ++j) {
+            ASSERT_ZERO(pthread_join(stripeThreads[i * stripes + j], NULL));
+        }
+    }
+    if (stripes > 1) {
+        for(int i = 0; i < worldSize; ++i) {
+            ASSERT_ZERO(pthread_mutex_destroy(&assemblies[i].mutex));
+            ASSERT_ZERO(pthread_cond_destroy(&assemblies[i].cond));
+        }
+        free(stripeReadDesc);
+        free(stripeWriteDesc);
+        free(stripeThreads);
+        free(stripeIds);
+        free(assemblies);
+        stripeReadDesc = NULL;
+        stripeWriteDesc = NULL;
+        stripeThreads = NULL;
+        stripeIds = NULL;
+        assemblies = NULL;
+    }
+    free((void*)threadStarted);
+    ASSERT_ZERO(pthread_mutex_destroy(&threadsMutex));
+    finalizeControl();
+
+    if (getEnvInt("MIMPI_STATS", 0) == 1) {
+        printStatistics();
+    }
+
+    // Events that were not taken by the main thread:
+    for(int i = 0; i < worldSize; ++i) {
+        if (i != worldRank) {
+            drainEvents(i);
+        }
+        ASSERT_ZERO(pthread_mutex_destroy(&eventRings[i].overflowMutex));
+    }
+
+    // Structure of event rings:
+    free(eventRings);
+
+    // Descriptors:
+    for(int i = 0; i < worldSize; ++i) {
+
+        if(i < 3) {
+            if(gReadDesc[i] != -1) {
+                ASSERT_SYS_OK(close(gReadDesc[i]));
+            }
+            if(gWriteDesc[i] != -1) {
+                ASSERT_SYS_OK(close(gWriteDesc[i]));
+            }
+        }
+
+        if(mReadDesc[i] != -1) {
+            ASSERT_SYS_OK(close(mReadDesc[i]));
+        }
+        if(mWriteDesc[i] != -1) {
+            ASSERT_SYS_OK(close(mWriteDesc[i]));
+        }
+
+    }
+
+    // Structures of descriptors:
+    free(mReadDesc);
+    free(mWriteDesc);
+
+    free(gReadDesc);
+    free(gWriteDesc);
+
+    // Structures for many application threads:
+    if (threadLevel == MIMPI_THREAD_MULTIPLE) {
+        for(int i = 0; i < worldSize; ++i) {
+            ASSERT_ZERO(pthread_mutex_destroy(&peerMutexes[i]));
+        }
+        free(peerMutexes);
+        free(postedReceives);
+        peerMutexes = NULL;
+        postedReceives = NULL;
+        threadLevel = MIMPI_THREAD_SINGLE;
+    }
+    if (sendMutexes != NULL) {
+        for(int i = 0; i < worldSize; ++i) {
+            ASSERT_ZERO(pthread_mutex_destroy(&sendMutexes[i]));
+        }
+        free(sendMutexes);
+        sendMutexes = NULL;
+    }
+
+    // Flow control structures:
+    if (eagerCredit > 0) {
+        for(int i = 0; i < worldSize; ++i) {
+            while (clearances[i] != NULL) {
+                struct Clearance* next = clearances[i]->next;
+                free(clearances[i]);
+                clearances[i] = next;
+            }
+        }
+        free(sendCredits);
+        free(returnedCredits);
+        free(rendezvousIds);
+        free(clearances);
+        sendCredits = NULL;
+        returnedCredits = NULL;
+        rendezvousIds = NULL;
+        clearances = NULL;
+        ASSERT_ZERO(pthread_mutex_destroy(&clearanceMutex));
+        ASSERT_ZERO(pthread_cond_destroy(&clearanceCond));
+        eagerCredit = 0;
+    }
+
+    // Structure of coalesce buffers:
+    free(coalesceBuffers);
+    coalesceBuffers = NULL;
+
+    // Structure of final flags:
+    free(finalFlags);
+
+    // Deadlock detection:
+    if(deadlockDetection == 1) {
+
+        // Counters structures:
+        freeCounters(sentCounters);
+        freeCounters(receivedCounters);
+        free(probeSenders);
+        free(probeEpochs);
+        sentCounters = NULL;
+        receivedCounters = NULL;
+        probeSenders = NULL;
+        probeEpochs = NULL;
+        ASSERT_ZERO(pthread_mutex_destroy(&detectorMutex));
+        deadlockDetection = 0;
+    }
+
+    // Contents of waiting messages:
+    for(int i = 0; i < worldSize; ++i) {
+        struct WaitingMessageParameters* current = waitingMessages[i];
+        while (current != NULL) {
+            struct WaitingMessageParameters* next = current->next;
+            free(current->data);
+            free(current);
+            current = next;
+        }
+    }
+
+    // Structure of waiting messages:
+    free(waitingMessages);
+
+    // Shared segment:
+    if (sharedControl != NULL) {
+        ASSERT_SYS_OK(munmap(sharedControl, sharedSize));
+        sharedControl = NULL;
+        sharedData = NULL;
+    }
+
+    // Windows (their memory went with the segment):
+    for(int i = 0; i < windowCount; ++i) {
+        free(windows[i].offsets);
+        free(windows[i].sizes);
+    }
+    free(windows);
+    windows = NULL;
+    windowCount = 0;
+
+    // Communicators (including the ones that were not freed):
+    for(int i = 0; i < communicatorCount; ++i) {
+        free(communicators[i].worldRanks);
+        free(communicators[i].dims);
+        free(communicators[i].periods);
+        free(communicators[i].neighbors);
+    }
+    free(communicators);
+    communicators = NULL;
+    communicatorCount = 0;
+    uringEngine = 0;
+
+    // Datatypes:
+    for(int i = 0; i < datatypeCount; ++i) {
+        free(datatypes[i].blocks);
+    }
+    free(datatypes);
+    datatypes = NULL;
+    datatypeCount = 0;
+
+    free(userOps);
+    userOps = NULL;
+    userOpCount = 0;
+
+    // Requests (including the ones that were not freed):
+    for(int i = 0; i < requestCount; ++i) {
+        if (requests[i] != NULL) {
+            ASSERT_ZERO(pthread_cond_destroy(&requests[i]->posted.cond));
+            free(requests[i]);
+        }
+    }
+    free(requests);
+    requests = NULL;
+    requestCount = 0;
+
+    channels_finalize();
+}
+
+int MIMPI_World_size() {
+    return worldSize;
+}
+
+int MIMPI_World_rank() {
+    return worldRank;
+}
+
+void recordSent(int destination, int count, long tag) {
+    countMessage(sentCounters, destination, count, tag);
+}
+
+// Part of a striped message written by a helper thread:
+struct StripeWrite {
+    int desc;
+    char header[FRAME_SIZE];
+    const char* data;
+    long size;
+    int result;
+};
+
+void* stripeWriterFunction(void* arg) {
+    struct StripeWrite* job = (struct StripeWrite*)arg;
+
+    // Destination may exit before the part is written:
+    sigset_t blocked;
+    ASSERT_SYS_OK(sigemptyset(&blocked));
+    ASSERT_SYS_OK(sigaddset(&blocked, SIGPIPE));
+    ASSERT_ZERO(pthread_sigmask(SIG_BLOCK, &blocked, NULL));
+
+    job->result = sendAll(job->desc, job->header, FRAME_SIZE) == -1 ? -1 : sendAll(job->desc, job->data, job->size);
+    return NULL;
+}
+
+// Header on the main channel, then every channel gets its part at the same time (the first part goes on the
+// main channel, padded up to the frame size), returns -1 on failure.
+int writeStriped(void const *data, int count, int destination, char type, long tag) {
+    stripedSends++;
+    int id = ++stripeIds[destination];
+
+    char header[FRAME_SIZE] = {0};
+    header[FRAME_TYPE] = 's';
+    header[STRIPE_KIND] = type;
+    encodeNumber(header, STRIPE_ID_FIRST, STRIPE_ID_LAST, id);
+    encodeTag(header, tag);
+    encodeNumber(header, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, count);
+    if (sendAll(mWriteDesc[destination], header, FRAME_SIZE) == -1) {
+        return -1;
+    }
+
+    struct StripeWrite jobs[stripes];
+    pthread_t helpers[stripes];
+    for(int i = 1; i < stripes; ++i) {
+        jobs[i].desc = stripeWriteDesc[destination * stripes + i];
+        memset(jobs[i].header, 0, FRAME_SIZE);
+        encodeNumber(jobs[i].header, STRIPE_ID_FIRST, STRIPE_ID_LAST, id);
+        encodeNumber(jobs[i].header, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, count);
+        jobs[i].data = (const char*)data + partStart(count, i);
+        jobs[i].size = partStart(count, i + 1) - partStart(count, i);
+        ASSERT_ZERO(pthread_create(&helpers[i], NULL, stripeWriterFunction, &jobs[i]));
+    }
+
+    int result = sendAll(mWriteDesc[destination], data, partStart(count, 1));
+    int padding = (FRAME_SIZE - partStart(count, 1)%FRAME_SIZE) % FRAME_SIZE;
+    if (result == 0 && padding > 0) {
+        char zeros[FRAME_SIZE] = {0};
+        result = sendAll(mWriteDesc[destination], zeros, padding);
+    }
+
+    for(int i = 1; i < stripes; ++i) {
+        ASSERT_ZERO(pthread_join(helpers[i], NULL));
+        result = jobs[i].result == -1 ? -1 : result;
+    }
+    return result;
+}
+
+// Writes the header frame, full frames straight from data and the padded last frame, returns -1 on failure.
+// Data laid out by a datatype is gathered into frames, a batch of them per write, or written block by block.
+// Header is the first frame with parameters already encoded and no payload (NULL to encode them here).
+int writeMessage(void const *data, int count, const struct Datatype* layout, int destination, char type, long tag, const char* header) {
+    if (stripes > 1 && layout == NULL && count >= stripeBytes) {
+        return writeStriped(data, count, destination, type, tag);
+    }
+
+    int remaining = count;
+    int offset = 0;
+    int chunkSize;
+
+    // First frame, with parameters:
+
+    char smallBuffer[FRAME_SIZE] = {0};
+    if (header != NULL) {
+        memcpy(smallBuffer, header, FRAME_SIZE);
+    } else {
+        smallBuffer[FRAME_TYPE] = type;
+        encodeTag(smallBuffer, tag);
+        encodeNumber(smallBuffer, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, count);
+    }
+
+    // Fill the rest of first frame with content:
+    chunkSize = MIN(remaining, FIRST_PAYLOAD_SIZE);
+    gatherMessage(smallBuffer, data, layout, offset, chunkSize);
+
+    // Send first frame:
+    if (sendAll(mWriteDesc[destination], smallBuffer, FRAME_SIZE) == -1) {
+        return -1;
+    }
+
+    remaining -= chunkSize;
+    offset += chunkSize;
+
+    // Other frames, without parameters:
+
+    // Full frames are sent straight from the user buffer in one go:
+    chunkSize = remaining - remaining%FRAME_SIZE;
+    if (chunkSize > 0 && layout == NULL) {
+        if (sendAll(mWriteDesc[destination], data + offset, chunkSize) == -1) {
+            return -1;
+        }
+        remaining -= chunkSize;
+        offset += chunkSize;
+    }
+    // Blocks of a frame or more on average (like pieces of MIMPI_Sendv) are written one after another:
+    if (chunkSize > 0 && layout != NULL && layout->size >= (long)layout->blockCount * FRAME_SIZE) {
+        if (sendTyped(mWriteDesc[destination], data, layout, offset, chunkSize) == -1) {
+            return -1;
+        }
+        remaining -= chunkSize;
+        offset += chunkSize;
+    } else if (chunkSize > 0 && layout != NULL) {
+        char batch[READ_BATCH_SIZE];
+        while (remaining >= FRAME_SIZE) {
+            chunkSize = MIN(remaining - remaining%FRAME_SIZE, READ_BATCH_SIZE);
+            gatherMessage(batch, data, layout, offset, chunkSize);
+            if (sendAll(mWriteDesc[destination], batch, chunkSize) == -1) {
+                return -1;
+            }
+            remaining -= chunkSize;
+            offset += chunkSize;
+        }
+    }
+
+    // Last frame is padded up to the frame size:
+    if (remaining > 0) {
+        gatherMessage(smallBuffer, data, layout, offset, remaining);
+        if (sendAll(mWriteDesc[destination], smallBuffer, FRAME_SIZE) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Writes the message to the destination (with the header frame, if it is not NULL), sending lock has to be held.
+MIMPI_Retcode sendMessage(void const *data, int count, const struct Datatype* layout, int destination, long tag, const char* header) {
+
+    // Eager message uses credits, they come back when the destination receives it:
+    if (eagerCredit > 0) {
+        atomic_fetch_sub(&sendCredits[destination], count);
+    }
+
+    // Small message is packed together with other ones for the same destination:
+    if (coalesceBuffers != NULL && count + COALESCE_ENTRY_HEADER <= FIRST_PAYLOAD_SIZE) {
+        struct CoalesceBuffer* buffer = &coalesceBuffers[destination];
+
+        if (buffer->used + COALESCE_ENTRY_HEADER + count > FIRST_PAYLOAD_SIZE) {
+            if (flushCoalesced(destination) == -1) {
+                return MIMPI_ERROR_REMOTE_FINISHED;
+            }
+        }
+        if (buffer->entries == 0) {
+            ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &buffer->firstEntry));
+            armFlusher();
+        }
+
+        // Append entry:
+        encodeNumber(buffer->frame, buffer->used, buffer->used + COALESCE_COUNT_DIGITS - 1, count);
+        buffer->used += COALESCE_COUNT_DIGITS;
+        encodeNumber(buffer->frame, buffer->used, buffer->used + COALESCE_CONTEXT_DIGITS - 1, TAG_CONTEXT(tag));
+        buffer->used += COALESCE_CONTEXT_DIGITS;
+        encodeNumber(buffer->frame, buffer->used, buffer->used + COALESCE_TAG_DIGITS - 1, USER_TAG(tag));
+        buffer->used += COALESCE_TAG_DIGITS;
+        gatherMessage(buffer->frame + buffer->used, data, layout, 0, count);
+        buffer->used += count;
+        buffer->entries++;
+
+        // Size or time threshold:
+        if (buffer->used >= coalesceBytes || coalesceDelayPassed(buffer)) {
+            if (flushCoalesced(destination) == -1) {
+                return MIMPI_ERROR_REMOTE_FINISHED;
+            }
+        }
+        return MIMPI_SUCCESS;
+    }
+
+    // Earlier small messages have to arrive first:
+    if (coalesceBuffers != NULL && flushCoalesced(destination) == -1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    if (writeMessage(data, count, layout, destination, 'm', tag, header) == -1) {
+        return MIMPI_ERROR_REMOTE_FINISHED; // the remote process involved in communication has finished
+    }
+
+    return MIMPI_SUCCESS;
+}
+
+// Writes the request to send, returns its id or -1 if the destination has finished.
+int requestToSend(int count, int destination, long tag) {
+    rendezvousSends++;
+
+    lockSend(destination);
+
+    // Earlier small messages have to arrive first:
+    if (coalesceBuffers != NULL && flushCoalesced(destination) == -1) {
+        unlockSend(destination);
+        return -1;
+    }
+
+    int id = ++rendezvousIds[destination];
+    char request[FRAME_SIZE] = {0};
+    request[FRAME_TYPE] = 'r';
+    encodeNumber(request, RENDEZVOUS_ID_FIRST, RENDEZVOUS_ID_LAST, id);
+    encodeTag(request, tag);
+    encodeNumber(request, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, count);
+    int passedInfo = sendAll(mWriteDesc[destination], request, FRAME_SIZE);
+    unlockSend(destination);
+
+    return passedInfo == -1 ? -1 : id;
+}
+
+// Request to send, then the data once the destination has matched it with a receive.
+MIMPI_Retcode sendRendezvous(void const *data, int count, const struct Datatype* layout, int destination, long tag) {
+    int id = requestToSend(count, destination, tag);
+    if (id == -1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    // Wait for the receive, the destination may finish without it:
+    int cleared = 0;
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    while ((cleared = takeClearance(destination, id)) == 0 && finalFlags[destination] == 0) {
+        ASSERT_ZERO(pthread_cond_wait(&clearanceCond, &clearanceMutex));
+    }
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+    if (cleared == 0) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    lockSend(destination);
+    int passedInfo = writeMessage(data, count, layout, destination, 'p', id, NULL);
+    unlockSend(destination);
+
+    return passedInfo == -1 ? MIMPI_ERROR_REMOTE_FINISHED : MIMPI_SUCCESS;
+}
+
+// Writes the data of pending sends in the order their destinations clear them.
+void* payloadWriterFunction(void* arg) {
+    (void)arg;
+
+    // Destination may exit before it clears the request:
+    sigset_t blocked;
+    ASSERT_SYS_OK(sigemptyset(&blocked));
+    ASSERT_SYS_OK(sigaddset(&blocked, SIGPIPE));
+    ASSERT_ZERO(pthread_sigmask(SIG_BLOCK, &blocked, NULL));
+
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    while (pendingPayloads != NULL || payloadsStopping == 0) {
+        struct Request** previousNext = &pendingPayloads;
+        while (*previousNext != NULL && takeClearance((*previousNext)->peer, (*previousNext)->rendezvousId) == 0 &&
+               finalFlags[(*previousNext)->peer] == 0) {
+            previousNext = &(*previousNext)->nextPending;
+        }
+        if (*previousNext == NULL) {
+            ASSERT_ZERO(pthread_cond_wait(&clearanceCond, &clearanceMutex));
+            continue;
+        }
+
+        struct Request* r = *previousNext;
+        *previousNext = r->nextPending;
+        ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+
+        // A destination that has finished does not clear anything:
+        MIMPI_Retcode result = MIMPI_ERROR_REMOTE_FINISHED;
+        if (finalFlags[r->peer] == 0) {
+            lockSend(r->peer);
+            int passedInfo = writeMessage(r->data, r->count, NULL, r->peer, 'p', r->rendezvousId, NULL);
+            unlockSend(r->peer);
+            result = passedInfo == -1 ? MIMPI_ERROR_REMOTE_FINISHED : MIMPI_SUCCESS;
+        }
+
+        ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+        r->result = result;
+        r->pending = 0;
+        ASSERT_ZERO(pthread_cond_broadcast(&clearanceCond));
+    }
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+
+    return NULL;
+}
+
+// Leaves the data of the request to the payload writer, once the request to send is written.
+MIMPI_Retcode pendPayload(struct Request* r) {
+    int id = requestToSend(r->count, r->peer, r->tag);
+    if (id == -1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    r->rendezvousId = id;
+    r->pending = 1;
+    r->nextPending = pendingPayloads;
+    pendingPayloads = r;
+    if (payloadWriterStarted == 0) {
+        ASSERT_ZERO(pthread_create(&payloadWriter, NULL, payloadWriterFunction, NULL));
+        payloadWriterStarted = 1;
+    }
+    ASSERT_ZERO(pthread_cond_broadcast(&clearanceCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+    return MIMPI_SUCCESS;
+}
+
+// Send of a started request that has waited in the queue of its destination (it is pending until written).
+void sendQueuedRequest(struct Request* r) {
+    MIMPI_Retcode result = MIMPI_ERROR_REMOTE_FINISHED;
+    if (finalFlags[r->peer] == 0) {
+        lockSend(r->peer);
+        if (r->count > atomic_load(&sendCredits[r->peer])) {
+            unlockSend(r->peer);
+            if (pendPayload(r) == MIMPI_SUCCESS) {
+                return;
+            }
+        } else {
+            result = sendMessage(r->data, r->count, NULL, r->peer, r->tag, r->header);
+            unlockSend(r->peer);
+        }
+    }
+
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    r->result = result;
+    r->pending = 0;
+    ASSERT_ZERO(pthread_cond_broadcast(&clearanceCond));
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+}
+
+// Sends the message with the calling thread.
+MIMPI_Retcode sendNow(void const *data, int count, const struct Datatype* layout, int destination, long tag) {
+    lockSend(destination);
+
+    // Not enough credits, the message goes when the destination is ready for it:
+    if (eagerCredit > 0 && count > atomic_load(&sendCredits[destination])) {
+        unlockSend(destination);
+        return sendRendezvous(data, count, layout, destination, tag);
+    }
+
+    MIMPI_Retcode result = sendMessage(data, count, layout, destination, tag, NULL);
+    unlockSend(destination);
+
+    return result;
+}
+
+// Writer thread of one destination, sends queued messages in order.
+void* writerThreadFunction(void* arg) {
+    int destination = *(int*)arg;
+    free(arg);
+
+    // Destination may exit before the queue is empty:
+    sigset_t blocked;
+    ASSERT_SYS_OK(sigemptyset(&blocked));
+    ASSERT_SYS_OK(sigaddset(&blocked, SIGPIPE));
+    ASSERT_ZERO(pthread_sigmask(SIG_BLOCK, &blocked, NULL));
+
+    struct SendQueue* queue = &sendQueues[destination];
+    ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+    while (true) {
+        while (queue->head == NULL && queuesStopping == 0) {
+            ASSERT_ZERO(pthread_cond_wait(&queueCond, &queueMutex));
+        }
+        if (queue->head == NULL) {
+            break;
+        }
+
+        struct QueuedSend* entry = queue->head;
+        queue->head = entry->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->busy = 1;
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+
+        // Nobody waits for the result of a copy, a message for a finished process is lost like in MIMPI_Send:
+        if (entry->request != NULL) {
+            sendQueuedRequest(entry->request);
+        } else if (finalFlags[destination] == 0) {
+            sendNow(entry->data, entry->count, NULL, destination, entry->tag);
+        }
+
+        // Receives flush small messages before they wait, but that one could still be in the queue then
+        // (the pipe may be full, so other queues must not wait for the flush):
+        ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+        int drained = queue->head == NULL;
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+        if (drained == 1 && coalesceBuffers != NULL) {
+            lockSend(destination);
+            flushCoalesced(destination);
+            unlockSend(destination);
+        }
+
+        ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+        if (entry->request == NULL) {
+            if (entry->attached == 1) {
+                attachedUsed -= entry->count;
+            } else {
+                queueUsed -= entry->count;
+            }
+            free(entry->data);
+        }
+        queue->busy = 0;
+        free(entry);
+        ASSERT_ZERO(pthread_cond_broadcast(&queueCond));
+    }
+    ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+
+    return NULL;
+}
+
+// Puts the entry at the end of the queue of the destination (queueMutex has to be held).
+void appendToQueue(int destination, struct QueuedSend* entry) {
+    struct SendQueue* queue = &sendQueues[destination];
+    if (queue->tail == NULL) {
+        queue->head = entry;
+    } else {
+        queue->tail->next = entry;
+    }
+    queue->tail = entry;
+
+    // Writer of the destination starts with its first message:
+    if (queue->started == 0) {
+        int* worker_arg = malloc(sizeof(int));
+        if (worker_arg == NULL) {
+            perror("Memory allocation error in worker_arg");
+            exit(EXIT_FAILURE);
+        }
+        *worker_arg = destination;
+        ASSERT_ZERO(pthread_create(&queue->writer, NULL, writerThreadFunction, worker_arg));
+        queue->started = 1;
+    }
+    ASSERT_ZERO(pthread_cond_broadcast(&queueCond));
+}
+
+// Copies the message to the queue of the destination if it fits in the budget (waits for space),
+// bigger message is sent by the calling thread once the queue is empty.
+MIMPI_Retcode queueSend(void const *data, int count, const struct Datatype* layout, int destination, long tag, int attached) {
+    ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+    int budget = attached == 1 ? attachedSize : queueBudget;
+    if (count > budget) {
+        waitForQueue(destination);
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+        return sendNow(data, count, layout, destination, tag);
+    }
+
+    int waited = 0;
+    while ((attached == 1 ? attachedUsed : queueUsed) + count > budget) {
+        waited = 1;
+        ASSERT_ZERO(pthread_cond_wait(&queueCond, &queueMutex));
+    }
+    if (waited == 1) {
+        queueWaits++;
+    }
+
+    struct QueuedSend* entry = (struct QueuedSend*)malloc(sizeof(struct QueuedSend));
+    char* copy = (char*)malloc(MAX(count, 1) * sizeof(char));
+    if (entry == NULL || copy == NULL) {
+        perror("Memory allocation error in queued send");
+        exit(EXIT_FAILURE);
+    }
+    gatherMessage(copy, data, layout, 0, count);
+    entry->data = copy;
+    entry->count = count;
+    entry->tag = tag;
+    entry->attached = attached;
+    entry->request = NULL;
+    entry->next = NULL;
+
+    if (attached == 1) {
+        attachedUsed += count;
+    } else {
+        queueUsed += count;
+    }
+    appendToQueue(destination, entry);
+    queuedSends++;
+    ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+
+    return MIMPI_SUCCESS;
+}
+
+// Sends the message with a tag that carries the context of a communicator, data is laid out by layout
+// (NULL if contiguous) and count is the number of packed bytes.
+MIMPI_Retcode sendTagged(void const *data, int count, const struct Datatype* layout, int destination, long tag) {
+
+    // Exceptions:
+    if(destination == worldRank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    } else if (destination < 0 || destination >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    // Credits, clearances and the final message come from the destination:
+    startReceiver(destination);
+
+    if (finalFlags[destination] == 1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    // If deadlock detection is on, we want to count that message as sent (before it can be received):
+    recordSent(destination, count, tag);
+
+    if (queueBudget > 0) {
+        return queueSend(data, count, layout, destination, tag, 0);
+    }
+
+    // Messages from MIMPI_Bsend go first:
+    if (sendQueues != NULL) {
+        ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+        waitForQueue(destination);
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+    }
+
+    return sendNow(data, count, layout, destination, tag);
+}
+
+MIMPI_Retcode MIMPI_Send(
+        void const *data,
+        int count,
+        int destination,
+        int tag
+) {
+    return sendTagged(data, count, NULL, destination, tag);
+}
+
+MIMPI_Retcode MIMPI_Bsend(
+        void const *data,
+        int count,
+        int destination,
+        int tag
+) {
+
+    // Exceptions:
+    if(destination == worldRank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    } else if (destination < 0 || destination >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    startReceiver(destination);
+
+    if (finalFlags[destination] == 1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    recordSent(destination, count, tag);
+
+    if (sendQueues == NULL) {
+        return sendNow(data, count, NULL, destination, tag);
+    }
+    return queueSend(data, count, NULL, destination, tag, 1);
+}
+
+MIMPI_Retcode MIMPI_Buffer_attach(void* buffer, int size) {
+    initSendQueues();
+
+    ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+    attachedBuffer = buffer;
+    attachedSize = MAX(size, 0);
+    ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Buffer_detach(void** buffer, int* size) {
+    if (sendQueues != NULL) {
+        ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+        while (attachedUsed > 0) {
+            ASSERT_ZERO(pthread_cond_wait(&queueCond, &queueMutex));
+        }
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+    }
+
+    if (buffer != NULL) {
+        *buffer = attachedBuffer;
+    }
+    if (size != NULL) {
+        *size = attachedSize;
+    }
+    attachedBuffer = NULL;
+    attachedSize = 0;
+
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Flush(int destination) {
+
+    // Exceptions:
+    if(destination == worldRank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    } else if (destination < 0 || destination >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    startReceiver(destination);
+
+    if (finalFlags[destination] == 1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    // Queued messages are written first:
+    if (sendQueues != NULL) {
+        ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+        waitForQueue(destination);
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+    }
+
+    MIMPI_Retcode result = MIMPI_SUCCESS;
+    lockSend(destination);
+    if (coalesceBuffers != NULL && flushCoalesced(destination) == -1) {
+        result = MIMPI_ERROR_REMOTE_FINISHED;
+    }
+    unlockSend(destination);
+
+    return result;
+}
+
+// Copies the oldest matching waiting message to data and removes it, returns 0 if there is none.
+// Returns 2 if that is a request to send: it is cleared, its number is stored for the data.
+// Tag of the message is stored in matchedTag.
+int takeWaitingMessage(int source, void* data, int count, const struct Datatype* layout, long tag, int* rendezvousId, long* matchedTag) {
+    struct WaitingMessageParameters* current = waitingMessages[source];
+    struct WaitingMessageParameters* previous = NULL;
+    while (current != NULL) {
+        // If we have a match:
+        if (current->type != EVENT_PAYLOAD && current->parameters.count == count && tagMatches(current->parameters.tag, tag)) {
+
+            if (previous == NULL) {
+                // If the node to be deleted is the head:
+                waitingMessages[source] = current->next;
+            } else {
+                // If the node to be deleted is not the head:
+                previous->next = current->next;
+            }
+
+            int result = 1;
+            *matchedTag = current->parameters.tag;
+            if (current->type == EVENT_RTS) {
+                *rendezvousId = current->id;
+                clearToSend(source, current->id);
+                result = 2;
+            } else {
+                scatterMessage(data, current->data, layout, 0, count);
+                countMessage(receivedCounters, source, count, current->parameters.tag);
+                returnCredit(source, count);
+            }
+
+            free(current->data);
+            free(current);
+            return result;
+        }
+        previous = current;
+        current = current->next;
+    }
+    return 0;
+}
+
+// Copies the data of a cleared request to send, returns 0 if it has not come yet.
+int takeRendezvousPayload(int source, void* data, const struct Datatype* layout, int id) {
+    struct WaitingMessageParameters** previousNext = &waitingMessages[source];
+    while (*previousNext != NULL) {
+        struct WaitingMessageParameters* current = *previousNext;
+        if (current->type == EVENT_PAYLOAD && current->id == id) {
+            *previousNext = current->next;
+            scatterMessage(data, current->data, layout, 0, current->parameters.count);
+            free(current->data);
+            free(current);
+            return 1;
+        }
+        previousNext = &current->next;
+    }
+    return 0;
+}
+
+// Posts the receive at the end of the list of the source, unless a waiting message completes it right away
+// (its status is set then). Peer mutex of the source has to be held.
+void postReceive(struct PostedReceive* posted, int source) {
+    int rendezvousId = -1;
+    long matchedTag = posted->parameters.tag;
+    int found = takeWaitingMessage(source, posted->data, posted->parameters.count, posted->type, posted->parameters.tag, &rendezvousId, &matchedTag);
+    posted->parameters.tag = matchedTag;
+    posted->rendezvousId = rendezvousId;
+    posted->next = NULL;
+    if (found == 1) {
+        posted->status = MIMPI_SUCCESS;
+        return;
+    }
+
+    // Final case:
+    if(found == 0 && finalFlags[source] == 1) {
+        posted->status = MIMPI_ERROR_REMOTE_FINISHED;
+        return;
+    }
+
+    posted->status = -1;
+    struct PostedReceive** last = &postedReceives[source];
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    *last = posted;
+}
+
+// Waits until the posted receive is completed, peer mutex of the source has to be held.
+void waitPosted(struct PostedReceive* posted, int source) {
+    if (posted->status != -1) {
+        return;
+    }
+
+    recvSleeps++;
+    while (posted->status == -1) {
+        ASSERT_ZERO(pthread_cond_wait(&posted->cond, &peerMutexes[source]));
+    }
+}
+
+// Receive with MIMPI_THREAD_MULTIPLE, the receiver thread of the source completes the posted receive.
+MIMPI_Retcode recvPosted(void* data, int count, const struct Datatype* layout, int source, long tag, long* receivedTag) {
+    struct PostedReceive posted;
+    posted.parameters.count = count;
+    posted.parameters.tag = tag;
+    posted.data = data;
+    posted.type = layout;
+    ASSERT_ZERO(pthread_cond_init(&posted.cond, NULL));
+
+    lockPeer(source);
+    postReceive(&posted, source);
+    waitPosted(&posted, source);
+    unlockPeer(source);
+
+    ASSERT_ZERO(pthread_cond_destroy(&posted.cond));
+    *receivedTag = posted.parameters.tag;
+    return posted.status;
+}
+
+// Receive with the main thread as the only consumer of event rings.
+MIMPI_Retcode recvFromRing(void* data, int count, const struct Datatype* layout, int source, long tag, long* receivedTag) {
+    int spun = 0;
+    int slept = 0;
+    int reason = WAKE_NONE;
+    int epoch = 0;
+    int rendezvousId = -1;
+    long matchedTag = tag;
+    struct timespec spinStart;
+
+    while (true) {
+
+        // Take everything that receiver thread has got from that process:
+        drainEvents(source);
+
+        // Request to send has been cleared, the data is on its way:
+        if (rendezvousId != -1) {
+            if (takeRendezvousPayload(source, data, layout, rendezvousId) == 1) {
+                countMessage(receivedCounters, source, count, matchedTag);
+                *receivedTag = matchedTag;
+                return MIMPI_SUCCESS;
+            }
+
+            // Sender has finished before the data came (events pushed before the flag have just been drained):
+            if (finalFlags[source] == 1 && !ringHasEvents(source)) {
+                return MIMPI_ERROR_REMOTE_FINISHED;
+            }
+            waitForEvents(source, count, tag, 0, 0);
+            continue;
+        }
+
+        // Find the message in waiting messages:
+        int found = takeWaitingMessage(source, data, count, layout, tag, &rendezvousId, &matchedTag);
+        if (found == 2) {
+            continue;
+        } else if (found == 1) {
+            if (spun == 1 && slept == 0) {
+                recvSpinHits++;
+                tuneSpinLimit(&spinStart, 1);
+            }
+            *receivedTag = matchedTag;
+            return MIMPI_SUCCESS;
+        }
+
+        // If the message is not on the list of waiting messages:
+
+        // Deadlock case (checked first, the process may have finished right after the cycle was found):
+        if(reason == WAKE_DEADLOCK || (epoch != 0 && atomic_load(&detectedEpoch) == epoch)) {
+            return MIMPI_ERROR_DEADLOCK_DETECTED;
+        }
+
+        // Final case (events pushed before the flag have just been drained):
+        if(reason == WAKE_FINAL || (finalFlags[source] == 1 && !ringHasEvents(source))) {
+            return MIMPI_ERROR_REMOTE_FINISHED;
+        }
+
+        // Spin for a while before going to sleep, the message may be about to come:
+        if (spinMax > 0 && slept == 0) {
+            if (spun == 0) {
+                spun = 1;
+                ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &spinStart));
+            }
+            if (spinForArrival(source, &spinStart) == 1) {
+                continue;
+            }
+        }
+
+        // Wait for the message to appear:
+        if (slept == 0) {
+            slept = 1;
+            recvSleeps++;
+            if (spun == 1) {
+                tuneSpinLimit(&spinStart, 0);
+            }
+            if (deadlockDetection == 1) {
+                epoch = setBlocked(source, count, tag);
+            }
+        }
+        reason = waitForEvents(source, count, tag, epoch, deadlockDetection == 1 ? deadlockGrace : 0);
+
+        // Blocked for the grace period, ask whether that is a deadlock:
+        if (reason == WAKE_TIMEOUT) {
+            startProbe();
+        }
+    }
+}
+
+// Receives the message with a tag that carries the context of a communicator, into data laid out by layout.
+// Tag of the received message is stored in receivedTag (unless it is NULL).
+MIMPI_Retcode recvTagged(void *data, int count, const struct Datatype* layout, int source, long tag, long* receivedTag) {
+    long matchedTag = tag;
+    if (receivedTag == NULL) {
+        receivedTag = &matchedTag;
+    }
+
+    // Exceptions:
+    if(source == worldRank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    } else if (source < 0 || source >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    startReceiver(source);
+
+    flushAllCoalesced();
+
+    if (threadLevel == MIMPI_THREAD_MULTIPLE) {
+        return recvPosted(data, count, layout, source, tag, receivedTag);
+    }
+
+    MIMPI_Retcode result = recvFromRing(data, count, layout, source, tag, receivedTag);
+
+    // The receive does not block anymore:
+    if (deadlockDetection == 1 && blockedOn != -1) {
+        setBlocked(-1, -1, -1);
+    }
+    return result;
+}
+
+MIMPI_Retcode MIMPI_Recv(
+        void *data,
+        int count,
+        int source,
+        int tag
+) {
+    return recvTagged(data, count, NULL, source, tag, NULL);
+}
+
+MIMPI_Retcode MIMPI_Barrier() { // (2log_2)
+
+    flushAllCoalesced();
+
+    char messBuffer[512] = {0};
+    char result = 'g';
+
+    int passedInfo;
+
+    // Left child:
+    if(leftChild != -1) {
+        // Get message:
+        passedInfo = 0;
+        while(passedInfo != 512) {
+            passedInfo = (int)chrecv(gReadDesc[1], messBuffer, 512);
+        }
+        // Update result:
+        if(messBuffer[511] != 'g') {
+            result = 'd';
+        }
+        messBuffer[511] = 0;
+    }
+
+    // Right child:
+    if(rightChild != -1) {
+        // Get message:
         passedInfo = 0;
         while(passedInfo != 512) {
             passedInfo = (int)chrecv(gReadDesc[2], messBuffer, 512);
         }
-        // Update result:
-        if(messBuffer[511] != 'g') {
-            result = 'd';
+        // Update result:
+        if(messBuffer[511] != 'g') {
+            result = 'd';
+        }
+        messBuffer[511] = 0;
+    }
+
+    // Parent (I am not the root of the tree):
+    if(parentNode != -1) {
+        // Update result:
+        messBuffer[511] = result;
+        // Send message:
+        passedInfo = 0;
+        while (passedInfo != 512) {
+            passedInfo = (int)chsend(gWriteDesc[0], messBuffer, 512);
+        }
+        // Get message:
+        passedInfo = 0;
+        while (passedInfo != 512) {
+            passedInfo = (int)chrecv(gReadDesc[0], messBuffer, 512);
+        }
+        // Update result:
+        result = messBuffer[511];
+    }
+
+    // Left child:
+    if(leftChild != -1) {
+        // Send message:
+        messBuffer[511] = result;
+        passedInfo = 0;
+        while(passedInfo != 512) {
+            passedInfo = (int)chsend(gWriteDesc[1], messBuffer, 512);
+        }
+    }
+
+    // Right child:
+    if(rightChild != -1) {
+        // Send message:
+        messBuffer[511] = result;
+        passedInfo = 0;
+        while(passedInfo != 512) {
+            passedInfo = (int)chsend(gWriteDesc[2], messBuffer, 512);
+        }
+    }
+
+    // Get result:
+    if(result == 'g') {
+        return MIMPI_SUCCESS;
+    } else {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+}
+
+// Barrier of all processes in the shared segment, returns -1 if some process has finished.
+int sharedBarrier() {
+    int generation = atomic_load(&sharedControl->generation);
+    if (generation & SHARED_FINISHED) {
+        return -1;
+    }
+
+    // The last process to come starts the next generation:
+    if (atomic_fetch_add(&sharedControl->arrived, 1) == worldSize - 1) {
+        atomic_store(&sharedControl->arrived, 0);
+        int next = (generation + 1) & (SHARED_FINISHED - 1);
+        if (!atomic_compare_exchange_strong(&sharedControl->generation, &generation, next)) {
+            return -1;
+        }
+        futexWakeShared(&sharedControl->generation);
+        return 0;
+    }
+
+    int current;
+    while ((current = atomic_load(&sharedControl->generation)) == generation) {
+        futexWaitShared(&sharedControl->generation, generation);
+    }
+
+    // Barrier is passed if the next generation has started (a process may have finished right after it):
+    return (current & (SHARED_FINISHED - 1)) != generation ? 0 : -1;
+}
+
+// Root writes each chunk into the segment once, every other process copies it out.
+MIMPI_Retcode sharedBcast(void *data, int count, int root) {
+    int offset = 0;
+    do {
+        int chunkSize = MIN(count - offset, sharedBytes);
+        if (worldRank == root) {
+            memcpy(sharedData, (uint8_t*)data + offset, chunkSize);
+        }
+        if (sharedBarrier() == -1) {
+            return MIMPI_ERROR_REMOTE_FINISHED;
+        }
+        if (worldRank != root) {
+            memcpy((uint8_t*)data + offset, sharedData, chunkSize);
+        }
+        if (sharedBarrier() == -1) {
+            return MIMPI_ERROR_REMOTE_FINISHED;
+        }
+        offset += chunkSize;
+    } while (offset < count);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Bcast( // (2log_2)
+        void *data,
+        int count,
+        int root
+) {
+
+    // Exception:
+    if(root < 0 || root >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    flushAllCoalesced();
+
+    if (sharedControl != NULL) {
+        return sharedBcast(data, count, root);
+    }
+
+    // Declarations and initializations:
+    char messageBuffer[512] = {0};
+    char signalMessageBuffer[512] = {0};
+
+    char result = 'g';
+
+    int leftIsOnPath = 0;
+    int rightIsOnPath = 0;
+    int passedInfo;
+    int currentNode;
+
+    int remaining = count;
+    int senderMessageOffset = 0;
+    int receiverMessageOffset = 0;
+    int chunkSize;
+
+    // If we need to send / get more messages:
+    while(remaining > 0) {
+
+        chunkSize = (remaining > 511) ? 511 : remaining;
+
+        // Left child:
+        if(leftChild != -1) {
+
+            // Check if you lay on the path between the root of MIMPI_Bcast and the root of binary tree:
+            if(worldRank != root) {
+                currentNode = root;
+                while(currentNode != 0) {
+                    if(currentNode == leftChild) {
+                        leftIsOnPath = 1;
+                        break;
+                    }
+                    currentNode = (currentNode-1)/2;
+                }
+            }
+
+            // Get message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                if(leftIsOnPath == 1) {
+                    passedInfo = (int)chrecv(gReadDesc[1], messageBuffer, 512);
+                } else {
+                    passedInfo = (int)chrecv(gReadDesc[1], signalMessageBuffer, 512);
+                }
+            }
+
+            // Update result:
+            if(leftIsOnPath == 1) {
+                if(messageBuffer[511] != 'g') {
+                    result = 'd';
+                }
+                messageBuffer[511] = 0;
+            } else {
+                if(signalMessageBuffer[511] != 'g') {
+                    result = 'd';
+                }
+                signalMessageBuffer[511] = 0;
+            }
+
+        }
+
+        // Right child:
+        if(rightChild != -1) {
+
+            // Check if you lay on the path between the root of MIMPI_Bcast and the root of binary tree:
+            if(worldRank != root) {
+                currentNode = root;
+                while(currentNode != 0) {
+                    if(currentNode == rightChild) {
+                        rightIsOnPath = 1;
+                        break;
+                    }
+                    currentNode = (currentNode-1)/2;
+                }
+            }
+
+            // Get message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                if(rightIsOnPath == 1) {
+                    passedInfo = (int)chrecv(gReadDesc[2], messageBuffer, 512);
+                } else {
+                    passedInfo = (int)chrecv(gReadDesc[2], signalMessageBuffer, 512);
+                }
+            }
+
+            // Update result:
+            if(rightIsOnPath == 1) {
+                if(messageBuffer[511] != 'g') {
+                    result = 'd';
+                }
+                messageBuffer[511] = 0;
+            } else {
+                if(signalMessageBuffer[511] != 'g') {
+                    result = 'd';
+                }
+                signalMessageBuffer[511] = 0;
+            }
+        }
+
+        // Parent (I am not the root of the tree):
+        if(parentNode != -1) {
+
+            // I am not the root of MIMPI_Bcast:
+            if(worldRank != root) {
+
+                // Send message:
+                if(leftIsOnPath == 1 || rightIsOnPath == 1) {
+                    messageBuffer[511] = result;
+                    passedInfo = 0;
+                    while (passedInfo != 512) {
+                        passedInfo = (int)chsend(gWriteDesc[0], messageBuffer, 512);
+                    }
+
+                } else {
+                    signalMessageBuffer[511] = result;
+                    passedInfo = 0;
+                    while (passedInfo != 512) {
+                        passedInfo = (int)chsend(gWriteDesc[0], signalMessageBuffer, 512);
+                    }
+                }
+
+            // I am the root of MIMPI_Bcast:
+            } else {
+
+                // Create message:
+                messageBuffer[511] = result;
+                memcpy(messageBuffer, data + senderMessageOffset, chunkSize);
+                senderMessageOffset += chunkSize;
+
+                // Send message:
+                passedInfo = 0;
+                while(passedInfo != 512) {
+                    passedInfo = (int)chsend(gWriteDesc[0], messageBuffer, 512);
+                }
+
+            }
+
+            // Get message:
+            passedInfo = 0;
+            while (passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[0], messageBuffer, 512);
+            }
+            result = messageBuffer[511];
+
+        // I am the root of the tree:
+        } else {
+            // I am the root of MIMPI_Bcast:
+            if(worldRank == root) {
+                // Create message:
+                messageBuffer[511] = result;
+                memcpy(messageBuffer, data + senderMessageOffset, chunkSize);
+                senderMessageOffset += chunkSize;
+            }
+
+        }
+
+        // I am not the root of MIMPI_Bcast:
+        if(worldRank != root) {
+            // Save message:
+            memcpy(data + receiverMessageOffset, messageBuffer, chunkSize);
+            receiverMessageOffset += chunkSize;
+        }
+
+        // Left child:
+        if(leftChild != -1) {
+
+            // Send message:
+            messageBuffer[511] = result;
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[1], messageBuffer, 512);
+            }
+        }
+
+        // Right child:
+        if(rightChild != -1) {
+
+            // Send message:
+            messageBuffer[511] = result;
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[2], messageBuffer, 512);
+            }
+        }
+
+        remaining -= chunkSize;
+    }
+
+    // Get result:
+    if(result == 'g') {
+        return MIMPI_SUCCESS;
+    } else {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+}
+
+struct UserOp* findUserOp(MIMPI_Op op) {
+    int index = (int)op - USER_OP_FIRST;
+    if (index < 0 || index >= userOpCount || userOps[index].function == NULL) {
+        return NULL;
+    }
+    return &userOps[index];
+}
+
+// Whether op is a predefined operator or a user operator that was not freed:
+bool validOp(MIMPI_Op op) {
+    return (op >= MIMPI_MAX && op <= MIMPI_PROD) || findUserOp(op) != NULL;
+}
+
+// Combines operand into result, byte by byte (user operators get the whole buffer, operand as their first argument).
+void applyOp(uint8_t* result, const uint8_t* operand, int count, MIMPI_Op op) {
+    if (op >= USER_OP_FIRST) {
+        int length = count;
+        MIMPI_Datatype type = MIMPI_BYTE;
+        findUserOp(op)->function(operand, result, &length, &type);
+        return;
+    }
+    for(int i = 0; i < count; ++i) {
+        if(op == MIMPI_MAX) {
+            result[i] = MAX(result[i], operand[i]);
+        } else if (op == MIMPI_MIN) {
+            result[i] = MIN(result[i], operand[i]);
+        } else if (op == MIMPI_SUM) {
+            result[i] = result[i] + operand[i];
+        } else if (op == MIMPI_PROD) {
+            result[i] = result[i] * operand[i];
+        }
+    }
+}
+
+// Every process puts its contribution into its slot, then reduces its own slice of all slots into slot 0.
+MIMPI_Retcode sharedReduce(void const *send_data, void *recv_data, int count, MIMPI_Op op, int root) {
+    int slotSize = sharedBytes / worldSize / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    if (slotSize == 0) {
+        fatal("Shared segment too small for %d processes", worldSize);
+    }
+
+    int offset = 0;
+    do {
+        int chunkSize = MIN(count - offset, slotSize);
+        memcpy(sharedData + worldRank * slotSize, (const uint8_t*)send_data + offset, chunkSize);
+        if (sharedBarrier() == -1) {
+            return MIMPI_ERROR_REMOTE_FINISHED;
+        }
+
+        int sliceFirst = chunkSize * worldRank / worldSize;
+        int sliceLast = chunkSize * (worldRank + 1) / worldSize;
+        for(int i = 1; i < worldSize; ++i) {
+            applyOp(sharedData + sliceFirst, sharedData + i * slotSize + sliceFirst, sliceLast - sliceFirst, op);
+        }
+        if (sharedBarrier() == -1) {
+            return MIMPI_ERROR_REMOTE_FINISHED;
+        }
+
+        if (worldRank == root) {
+            memcpy((uint8_t*)recv_data + offset, sharedData, chunkSize);
+        }
+        if (sharedBarrier() == -1) {
+            return MIMPI_ERROR_REMOTE_FINISHED;
+        }
+        offset += chunkSize;
+    } while (offset < count);
+    return MIMPI_SUCCESS;
+}
+
+// Reduction with a user operator in the binomial tree of the communicator: children of a member are the ones
+// 1, 2, 4 ... places above it (below its lowest set bit), so every subtree holds consecutive members and the operator
+// is called once per child on whole buffers. A commutative operator uses the tree rooted at root. Otherwise the tree
+// is in rank order, lower members are always the first operand and member 0 passes the result to root. The status
+// goes back down the tree, so all members learn that some process has finished.
+MIMPI_Retcode userReduce(struct Communicator* c, void const *send_data, void *recv_data, int count, MIMPI_Op op, int root) {
+    flushAllCoalesced();
+
+    struct UserOp* u = findUserOp(op);
+    int origin = u->commute ? root : 0;
+    int relative = (c->rank - origin + c->size) % c->size;
+    long tag = CONTEXT_TAG(c->context * 2 + 1, COLLECTIVE_TAG);
+    uint8_t status = 0;
+
+    uint8_t* partial = (uint8_t *)malloc(MAX(count, 1));
+    uint8_t* buffer = (uint8_t *)malloc(1 + count);
+    if (partial == NULL || buffer == NULL) {
+        perror("Memory allocation error in userReduce");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(partial, send_data, count);
+
+    // Children, each with the next range of members:
+    int mask = 1;
+    while (mask < c->size && (relative & mask) == 0) {
+        if (relative + mask < c->size) {
+            int child = c->worldRanks[(relative + mask + origin) % c->size];
+            if (recvTagged(buffer, 1 + count, NULL, child, tag, NULL) != MIMPI_SUCCESS || buffer[0] != 0) {
+                status = 1;
+            } else {
+                int length = count;
+                MIMPI_Datatype type = MIMPI_BYTE;
+                if (u->commute) {
+                    u->function(buffer + 1, partial, &length, &type);
+                } else {
+                    u->function(partial, buffer + 1, &length, &type);
+                    memcpy(partial, buffer + 1, count);
+                }
+            }
+        }
+        mask *= 2;
+    }
+
+    // Parent (the member mask places below):
+    if (relative != 0) {
+        buffer[0] = status;
+        memcpy(buffer + 1, partial, count);
+        if (sendTagged(buffer, 1 + count, NULL, c->worldRanks[(relative - mask + origin) % c->size], tag) != MIMPI_SUCCESS) {
+            status = 1;
+        }
+    }
+
+    // Result for root, when the tree is not rooted at it:
+    if (origin != root && relative == 0) {
+        buffer[0] = status;
+        memcpy(buffer + 1, partial, count);
+        if (sendTagged(buffer, 1 + count, NULL, c->worldRanks[root], tag) != MIMPI_SUCCESS) {
+            status = 1;
+        }
+    } else if (origin != root && c->rank == root) {
+        if (recvTagged(buffer, 1 + count, NULL, c->worldRanks[origin], tag, NULL) != MIMPI_SUCCESS || buffer[0] != 0) {
+            status = 1;
+        } else {
+            memcpy(partial, buffer + 1, count);
+        }
+    }
+
+    // Status from the parent, then to the children:
+    if (relative != 0) {
+        if (recvTagged(buffer, 1, NULL, c->worldRanks[(relative - mask + origin) % c->size], tag, NULL) != MIMPI_SUCCESS) {
+            status = 1;
+        } else {
+            status = MAX(status, buffer[0]);
+        }
+    }
+    for(int distance = 1; distance < mask && relative + distance < c->size; distance *= 2) {
+        buffer[0] = status;
+        sendTagged(buffer, 1, NULL, c->worldRanks[(relative + distance + origin) % c->size], tag);
+    }
+
+    if (c->rank == root) {
+        memcpy(recv_data, partial, count);
+    }
+    free(partial);
+    free(buffer);
+    return status == 0 ? MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+}
+
+MIMPI_Retcode MIMPI_Reduce( // (2log_2)
+        void const *send_data,
+        void *recv_data,
+        int count,
+        MIMPI_Op op,
+        int root
+)
+{
+
+    // Exception:
+    if(root < 0 || root >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK; /// no process with requested rank exists in the world (ROOT)
+    }
+
+    // User operator (called on whole buffers, not on chunks of frames):
+    if (op >= USER_OP_FIRST) {
+        return validOp(op) ? userReduce(&communicators[MIMPI_COMM_WORLD], send_data, recv_data, count, op, root) : MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    flushAllCoalesced();
+
+    if (sharedControl != NULL) {
+        return sharedReduce(send_data, recv_data, count, op, root);
+    }
+
+    // Declarations and initializations:
+    uint8_t leftMessageBuffer[512] = {0};
+    uint8_t rightMessageBuffer[512] = {0};
+    uint8_t upperMessageBuffer[512] = {0};
+
+    char result = 'g';
+
+    int passedInfo;
+    int remaining = count;
+    int senderMessageOffset = 0;
+    int receiverMessageOffset = 0;
+    int chunkSize;
+
+    // If we need to send / get more messages:
+    while(remaining > 0) {
+
+        // Create message:
+        chunkSize = (remaining > 511) ? 511 : remaining;
+        memcpy(upperMessageBuffer, send_data + senderMessageOffset, chunkSize);
+        senderMessageOffset += chunkSize;
+
+        // Left child:
+        if(leftChild != -1) {
+            // Get message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[1], leftMessageBuffer, 512);
+            }
+            // Update result:
+            if(leftMessageBuffer[511] != 'g') {
+                result = 'd';
+            }
+            leftMessageBuffer[511] = 0;
+            // Update message:
+            applyOp(upperMessageBuffer, leftMessageBuffer, chunkSize, op);
+
+        }
+
+        // Right child:
+        if(rightChild != -1) {
+            // Get message:
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[2], rightMessageBuffer, 512);
+            }
+            // Update result:
+            if(rightMessageBuffer[511] != 'g') {
+                result = 'd';
+            }
+            rightMessageBuffer[511] = 0;
+            // Update message:
+            applyOp(upperMessageBuffer, rightMessageBuffer, chunkSize, op);
+        }
+
+        // Parent (I am not the root of the tree):
+        if(parentNode != -1) {
+            // Update result:
+            upperMessageBuffer[511] = result;
+            // Send message:
+            passedInfo = 0;
+            while (passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[0], upperMessageBuffer, 512);
+            }
+            // Get message:
+            passedInfo = 0;
+            while (passedInfo != 512) {
+                passedInfo = (int)chrecv(gReadDesc[0], upperMessageBuffer, 512);
+            }
+            // Update result:
+            result = (char)upperMessageBuffer[511];
+        }
+
+        // I am the root of MIMPI_Reduce:
+        if(worldRank == root) {
+            // Save message:
+            memcpy(recv_data + receiverMessageOffset, upperMessageBuffer, chunkSize);
+            receiverMessageOffset += chunkSize;
+        }
+
+        // Left child:
+        if(leftChild != -1) {
+            // Send message
+            upperMessageBuffer[511] = result;
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[1], upperMessageBuffer, 512);
+            }
+        }
+
+        //Right child:
+        if(rightChild != -1) {
+            // Send message
+            upperMessageBuffer[511] = result;
+            passedInfo = 0;
+            while(passedInfo != 512) {
+                passedInfo = (int)chsend(gWriteDesc[2], upperMessageBuffer, 512);
+            }
+        }
+
+        remaining -= chunkSize;
+    }
+
+    // Get result:
+    if(result == 'g') {
+        return MIMPI_SUCCESS;
+    } else {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+}
+
+struct Communicator* findCommunicator(MIMPI_Comm comm) {
+    if (comm < 0 || comm >= communicatorCount || communicators[comm].worldRanks == NULL) {
+        return NULL;
+    }
+    return &communicators[comm];
+}
+
+// World rank of the member of the tree rooted at root, given by its rank relative to the root:
+int treeMember(struct Communicator* c, int root, int relative) {
+    return c->worldRanks[(relative + root) % c->size];
+}
+
+// Collective over point-to-point channels of the communicator, in the tree rooted at root. Data of the children
+// (upCount bytes) is combined into up with op on the way to the root, then the root sends down (downCount bytes)
+// to everyone. Every message starts with the status byte, so all members learn that some process has finished.
+MIMPI_Retcode commCollective(struct Communicator* c, int root, uint8_t* up, int upCount, MIMPI_Op op, uint8_t* down, int downCount) {
+    flushAllCoalesced();
+
+    long tag = CONTEXT_TAG(c->context * 2 + 1, COLLECTIVE_TAG);
+    int relative = (c->rank - root + c->size) % c->size;
+    uint8_t status = 0;
+
+    uint8_t* buffer = (uint8_t *)malloc(1 + MAX(upCount, downCount));
+    if (buffer == NULL) {
+        perror("Memory allocation error in buffer");
+        exit(EXIT_FAILURE);
+    }
+
+    // Children:
+    for(int child = 2 * relative + 1; child <= 2 * relative + 2 && child < c->size; ++child) {
+        if (recvTagged(buffer, 1 + upCount, NULL, treeMember(c, root, child), tag, NULL) != MIMPI_SUCCESS || buffer[0] != 0) {
+            status = 1;
+        } else {
+            applyOp(up, buffer + 1, upCount, op);
         }
-        messBuffer[511] = 0;
     }
 
     // Parent (I am not the root of the tree):
-    if(parentNode != -1) {
-        // Update result:
-        messBuffer[511] = result;
-        // Send message:
-        passedInfo = 0;
-        while (passedInfo != 512) {
-            passedInfo = (int)chsend(gWriteDesc[0], messBuffer, 512);
+    if (relative != 0) {
+        int parent = treeMember(c, root, (relative - 1) / 2);
+        buffer[0] = status;
+        memcpy(buffer + 1, up, upCount);
+        if (sendTagged(buffer, 1 + upCount, NULL, parent, tag) != MIMPI_SUCCESS) {
+            status = 1;
         }
-        // Get message:
-        passedInfo = 0;
-        while (passedInfo != 512) {
-            passedInfo = (int)chrecv(gReadDesc[0], messBuffer, 512);
+        if (recvTagged(buffer, 1 + downCount, NULL, parent, tag, NULL) != MIMPI_SUCCESS) {
+            status = 1;
+        } else {
+            status = MAX(status, buffer[0]);
+            memcpy(down, buffer + 1, downCount);
         }
-        // Update result:
-        result = messBuffer[511];
     }
 
-    // Left child:
-    if(leftChild != -1) {
-        // Send message:
-        messBuffer[511] = result;
-        passedInfo = 0;
-        while(passedInfo != 512) {
-            passedInfo = (int)chsend(gWriteDesc[1], messBuffer, 512);
-        }
+    // Children again, with the result:
+    for(int child = 2 * relative + 1; child <= 2 * relative + 2 && child < c->size; ++child) {
+        buffer[0] = status;
+        memcpy(buffer + 1, down, downCount);
+        sendTagged(buffer, 1 + downCount, NULL, treeMember(c, root, child), tag);
+    }
+
+    free(buffer);
+    return status == 0 ? MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+}
+
+int MIMPI_Comm_size(MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    return c == NULL ? -1 : c->size;
+}
+
+int MIMPI_Comm_rank(MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    return c == NULL ? -1 : c->rank;
+}
+
+MIMPI_Retcode MIMPI_Comm_split(MIMPI_Comm comm, int color, int key, MIMPI_Comm* newComm) {
+    *newComm = MIMPI_COMM_NULL;
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    // Every member puts (color, key) in its place and marks the contexts of its communicators, the maximum
+    // (bytes of other places are zero) gives the table of all members and the contexts used by any of them:
+    int size = c->size;
+    int entries = 2 * size;
+    int bytes = entries * sizeof(int) + CONTEXT_COUNT;
+    int* table = (int *)calloc(bytes, 1);
+    if (table == NULL) {
+        perror("Memory allocation error in table");
+        exit(EXIT_FAILURE);
+    }
+    uint8_t* used = (uint8_t *)(table + entries);
+    table[2 * c->rank] = color;
+    table[2 * c->rank + 1] = key;
+    for(int i = 0; i < communicatorCount; ++i) {
+        if (communicators[i].worldRanks != NULL) {
+            used[communicators[i].context] = 1;
+        }
+    }
+
+    if (commCollective(c, 0, (uint8_t *)table, bytes, MIMPI_MAX, (uint8_t *)table, bytes) != MIMPI_SUCCESS) {
+        free(table);
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    // Lowest context that no member uses (processes in different new communicators never talk in it),
+    // contexts of freed communicators are taken again:
+    int context = 1;
+    while (context < CONTEXT_COUNT && used[context] == 1) {
+        context++;
+    }
+    if (context == CONTEXT_COUNT || color == MIMPI_UNDEFINED) {
+        free(table);
+        return context == CONTEXT_COUNT ? MIMPI_ERROR_NO_SUCH_RANK : MIMPI_SUCCESS;
+    }
+
+    // Members with the same color, ordered by key (and then by the old rank):
+    int* worldRanks = (int *)malloc(size * sizeof(int));
+    int* keys = (int *)malloc(size * sizeof(int));
+    if (worldRanks == NULL || keys == NULL) {
+        perror("Memory allocation error in worldRanks");
+        exit(EXIT_FAILURE);
+    }
+    int newSize = 0;
+    int newRank = 0;
+    for(int i = 0; i < size; ++i) {
+        if (table[2 * i] != color) {
+            continue;
+        }
+        int position = newSize;
+        while (position > 0 && keys[position - 1] > table[2 * i + 1]) {
+            keys[position] = keys[position - 1];
+            worldRanks[position] = worldRanks[position - 1];
+            position--;
+        }
+        keys[position] = table[2 * i + 1];
+        worldRanks[position] = c->worldRanks[i];
+        newSize++;
+    }
+    for(int i = 0; i < newSize; ++i) {
+        if (worldRanks[i] == worldRank) {
+            newRank = i;
+        }
+    }
+
+    free(keys);
+    free(table);
+    *newComm = createCommunicator(newSize, newRank, worldRanks, context);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Comm_dup(MIMPI_Comm comm, MIMPI_Comm* newComm) {
+    return MIMPI_Comm_split(comm, 0, MIMPI_Comm_rank(comm), newComm);
+}
+
+MIMPI_Retcode MIMPI_Comm_free(MIMPI_Comm* comm) {
+    struct Communicator* c = findCommunicator(*comm);
+    if (c == NULL || *comm == MIMPI_COMM_WORLD) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    free(c->worldRanks);
+    free(c->dims);
+    free(c->periods);
+    free(c->neighbors);
+    c->worldRanks = NULL;
+    c->dims = NULL;
+    c->periods = NULL;
+    c->neighbors = NULL;
+    *comm = MIMPI_COMM_NULL;
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Comm_send(void const *data, int count, int destination, int tag, MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || destination < 0 || destination >= c->size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    return sendTagged(data, count, NULL, c->worldRanks[destination], CONTEXT_TAG(c->context * 2, tag));
+}
+
+MIMPI_Retcode MIMPI_Comm_recv(void *data, int count, int source, int tag, MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || source < 0 || source >= c->size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    return recvTagged(data, count, NULL, c->worldRanks[source], CONTEXT_TAG(c->context * 2, tag), NULL);
+}
+
+// Collectives of the world communicator use the tree of group channels:
+
+MIMPI_Retcode MIMPI_Comm_barrier(MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    } else if (comm == MIMPI_COMM_WORLD) {
+        return MIMPI_Barrier();
+    }
+    return commCollective(c, 0, NULL, 0, MIMPI_SUM, NULL, 0);
+}
+
+MIMPI_Retcode MIMPI_Comm_bcast(void *data, int count, int root, MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || root < 0 || root >= c->size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    } else if (comm == MIMPI_COMM_WORLD) {
+        return MIMPI_Bcast(data, count, root);
+    }
+    return commCollective(c, root, NULL, 0, MIMPI_SUM, data, count);
+}
+
+// Reduce over point-to-point channels of the communicator:
+MIMPI_Retcode channelReduce(struct Communicator* c, void const *send_data, void *recv_data, int count, MIMPI_Op op, int root) {
+    if (op >= USER_OP_FIRST) {
+        return userReduce(c, send_data, recv_data, count, op, root);
+    }
+
+    uint8_t* partial = (uint8_t *)malloc(MAX(count, 1));
+    if (partial == NULL) {
+        perror("Memory allocation error in partial");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(partial, send_data, count);
+
+    MIMPI_Retcode result = commCollective(c, root, partial, count, op, NULL, 0);
+    if (c->rank == root) {
+        memcpy(recv_data, partial, count);
+    }
+    free(partial);
+    return result;
+}
+
+MIMPI_Retcode MIMPI_Comm_reduce(void const *send_data, void *recv_data, int count, MIMPI_Op op, int root, MIMPI_Comm comm) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || root < 0 || root >= c->size || !validOp(op)) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    } else if (comm == MIMPI_COMM_WORLD) {
+        return MIMPI_Reduce(send_data, recv_data, count, op, root);
+    }
+    return channelReduce(c, send_data, recv_data, count, op, root);
+}
+
+// Lock in the shared segment (0 - free, 1 - taken, 2 - taken and someone may wait):
+void sharedLock(atomic_int* lock) {
+    int expected = 0;
+    if (atomic_compare_exchange_strong(lock, &expected, 1)) {
+        return;
+    }
+    if (expected != 2) {
+        expected = atomic_exchange(lock, 2);
+    }
+    while (expected != 0) {
+        futexWaitShared(lock, 2);
+        expected = atomic_exchange(lock, 2);
+    }
+}
+
+void sharedUnlock(atomic_int* lock) {
+    if (atomic_exchange(lock, 0) == 2) {
+        futexWakeShared(lock);
+    }
+}
+
+struct Window* findWindow(MIMPI_Win win) {
+    if (win < 0 || win >= windowCount || windows[win].offsets == NULL) {
+        return NULL;
+    }
+    return &windows[win];
+}
+
+atomic_int* windowLock(struct Window* w, int target, int accumulate) {
+    return (atomic_int*)((uint8_t*)sharedControl + w->locksOffset + (2 * target + accumulate) * CACHE_LINE_SIZE);
+}
+
+// Memory of the target, NULL if the access does not fit in its part of the window:
+uint8_t* windowMemory(struct Window* w, int target, int offset, int count) {
+    if (offset < 0 || count < 0 || (long)offset + count > w->sizes[target]) {
+        return NULL;
+    }
+    return (uint8_t*)sharedControl + w->offsets[target] + offset;
+}
+
+// Space below the lowest live window is left to collectives:
+void updateSharedHeap() {
+    int bottom = (int)sharedSize;
+    for(int i = 0; i < windowCount; ++i) {
+        if (windows[i].offsets != NULL) {
+            bottom = MIN(bottom, windows[i].bottom);
+        }
+    }
+    sharedBytes = bottom - (int)sizeof(struct SharedControl);
+}
+
+MIMPI_Retcode MIMPI_Win_create(int size, void** base, MIMPI_Win* win) {
+    *win = MIMPI_WIN_NULL;
+
+    // Every process has the same segment and the same windows, so all of them fail here together:
+    if (sharedControl == NULL || sharedBytes < worldSize * (int)sizeof(int)) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    flushAllCoalesced();
+
+    // Sizes of all processes go through the data area of collectives:
+    int* sizes = (int *)malloc(worldSize * sizeof(int));
+    int* offsets = (int *)malloc(worldSize * sizeof(int));
+    if (sizes == NULL || offsets == NULL) {
+        perror("Memory allocation error in window");
+        exit(EXIT_FAILURE);
+    }
+    ((int*)sharedData)[worldRank] = MAX(size, 0);
+    if (sharedBarrier() == -1) {
+        free(sizes);
+        free(offsets);
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+    memcpy(sizes, sharedData, worldSize * sizeof(int));
+
+    // Every process computes the same layout, downwards from the lowest window:
+    int top = (int)sizeof(struct SharedControl) + sharedBytes;
+    for(int i = worldSize - 1; i >= 0; --i) {
+        top -= (sizes[i] + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+        offsets[i] = top;
+    }
+    top -= 2 * worldSize * CACHE_LINE_SIZE;
+    int fits = top >= (int)sizeof(struct SharedControl) + worldSize * CACHE_LINE_SIZE;
+
+    // Sizes are read by everyone before the data area is used again (also when the window does not fit,
+    // which every process finds out from the same layout):
+    if (sharedBarrier() == -1 || fits == 0) {
+        free(sizes);
+        free(offsets);
+        return fits == 0 ? MIMPI_ERROR_NO_SUCH_RANK : MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    // Space could have been used by collectives, so locks and memory start zeroed:
+    int handle = 0;
+    while (handle < windowCount && windows[handle].offsets != NULL) {
+        handle++;
+    }
+    if (handle == windowCount) {
+        windows = (struct Window*)realloc(windows, (windowCount + 1) * sizeof(struct Window));
+        if (windows == NULL) {
+            perror("Memory allocation error in windows");
+            exit(EXIT_FAILURE);
+        }
+        windowCount++;
+    }
+    windows[handle].offsets = offsets;
+    windows[handle].sizes = sizes;
+    windows[handle].locksOffset = top;
+    windows[handle].bottom = top;
+    memset((uint8_t*)sharedControl + offsets[worldRank], 0, sizes[worldRank]);
+    memset(windowLock(&windows[handle], worldRank, 0), 0, 2 * CACHE_LINE_SIZE);
+    updateSharedHeap();
+
+    if (sharedBarrier() == -1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+
+    *base = (uint8_t*)sharedControl + offsets[worldRank];
+    *win = handle;
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Win_free(MIMPI_Win* win) {
+    struct Window* w = findWindow(*win);
+    if (w == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    // Nobody may still access the memory:
+    MIMPI_Retcode result = MIMPI_Barrier();
+
+    free(w->offsets);
+    free(w->sizes);
+    w->offsets = NULL;
+    w->sizes = NULL;
+    updateSharedHeap();
+    *win = MIMPI_WIN_NULL;
+    return result;
+}
+
+MIMPI_Retcode MIMPI_Put(void const *data, int count, int target, int offset, MIMPI_Win win) {
+    struct Window* w = findWindow(win);
+    if (w == NULL || target < 0 || target >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    uint8_t* memory = windowMemory(w, target, offset, count);
+    if (memory == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    memcpy(memory, data, count);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Get(void *data, int count, int target, int offset, MIMPI_Win win) {
+    struct Window* w = findWindow(win);
+    if (w == NULL || target < 0 || target >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    uint8_t* memory = windowMemory(w, target, offset, count);
+    if (memory == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    memcpy(data, memory, count);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Accumulate(void const *data, int count, MIMPI_Op op, int target, int offset, MIMPI_Win win) {
+    struct Window* w = findWindow(win);
+    if (w == NULL || target < 0 || target >= worldSize || !validOp(op)) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    // Accumulates of different processes to the same target do not interleave:
+    uint8_t* memory = windowMemory(w, target, offset, count);
+    if (memory == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    sharedLock(windowLock(w, target, 1));
+    applyOp(memory, data, count, op);
+    sharedUnlock(windowLock(w, target, 1));
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Win_fence(MIMPI_Win win) {
+    if (findWindow(win) == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    return MIMPI_Barrier();
+}
+
+MIMPI_Retcode MIMPI_Win_lock(int target, MIMPI_Win win) {
+    struct Window* w = findWindow(win);
+    if (w == NULL || target < 0 || target >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    sharedLock(windowLock(w, target, 0));
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Win_unlock(int target, MIMPI_Win win) {
+    struct Window* w = findWindow(win);
+    if (w == NULL || target < 0 || target >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    sharedUnlock(windowLock(w, target, 0));
+    return MIMPI_SUCCESS;
+}
+
+struct Datatype* findDatatype(MIMPI_Datatype type) {
+    if (type < 0 || type >= datatypeCount || datatypes[type].blocks == NULL) {
+        return NULL;
+    }
+    return &datatypes[type];
+}
+
+// Appends blocks of count elements of old, the first one at offset, merging blocks that touch:
+void appendElements(struct TypeBlock* blocks, int* blockCount, struct Datatype* old, long offset, int count) {
+    for(int element = 0; element < count; ++element) {
+        for(int i = 0; i < old->blockCount; ++i) {
+            long start = offset + element * old->extent + old->blocks[i].offset;
+            if (*blockCount > 0 && blocks[*blockCount - 1].offset + blocks[*blockCount - 1].length == start) {
+                blocks[*blockCount - 1].length += old->blocks[i].length;
+            } else {
+                blocks[*blockCount].offset = start;
+                blocks[*blockCount].length = old->blocks[i].length;
+                (*blockCount)++;
+            }
+        }
+    }
+}
+
+struct TypeBlock* allocateBlocks(long count) {
+    struct TypeBlock* blocks = (struct TypeBlock*)malloc(MAX(count, 1) * sizeof(struct TypeBlock));
+    if (blocks == NULL) {
+        perror("Memory allocation error in blocks");
+        exit(EXIT_FAILURE);
+    }
+    return blocks;
+}
+
+MIMPI_Retcode MIMPI_Type_vector(int count, int blockLength, int stride, MIMPI_Datatype oldType, MIMPI_Datatype* newType) {
+    *newType = MIMPI_DATATYPE_NULL;
+    struct Datatype* old = findDatatype(oldType);
+    if (old == NULL || count < 0 || blockLength < 0) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    struct TypeBlock* blocks = allocateBlocks((long)count * blockLength * old->blockCount);
+    int blockCount = 0;
+    long extent = 0;
+    for(int i = 0; i < count; ++i) {
+        appendElements(blocks, &blockCount, old, (long)i * stride * old->extent, blockLength);
+        extent = MAX(extent, ((long)i * stride + blockLength) * old->extent);
+    }
+    *newType = createDatatype(blocks, blockCount, extent);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Type_indexed(int count, int const *blockLengths, int const *displacements, MIMPI_Datatype oldType, MIMPI_Datatype* newType) {
+    *newType = MIMPI_DATATYPE_NULL;
+    struct Datatype* old = findDatatype(oldType);
+    if (old == NULL || count < 0) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    long total = 0;
+    for(int i = 0; i < count; ++i) {
+        if (blockLengths[i] < 0) {
+            return MIMPI_ERROR_NO_SUCH_RANK;
+        }
+        total += (long)blockLengths[i] * old->blockCount;
+    }
+    struct TypeBlock* blocks = allocateBlocks(total);
+    int blockCount = 0;
+    long extent = 0;
+    for(int i = 0; i < count; ++i) {
+        appendElements(blocks, &blockCount, old, (long)displacements[i] * old->extent, blockLengths[i]);
+        extent = MAX(extent, ((long)displacements[i] + blockLengths[i]) * old->extent);
+    }
+    *newType = createDatatype(blocks, blockCount, extent);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Type_struct(int count, int const *blockLengths, long const *displacements, MIMPI_Datatype const *types, MIMPI_Datatype* newType) {
+    *newType = MIMPI_DATATYPE_NULL;
+    if (count < 0) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    long total = 0;
+    for(int i = 0; i < count; ++i) {
+        if (findDatatype(types[i]) == NULL || blockLengths[i] < 0) {
+            return MIMPI_ERROR_NO_SUCH_RANK;
+        }
+        total += (long)blockLengths[i] * datatypes[types[i]].blockCount;
+    }
+    struct TypeBlock* blocks = allocateBlocks(total);
+    int blockCount = 0;
+    long extent = 0;
+    for(int i = 0; i < count; ++i) {
+        struct Datatype* old = &datatypes[types[i]];
+        appendElements(blocks, &blockCount, old, displacements[i], blockLengths[i]);
+        extent = MAX(extent, displacements[i] + blockLengths[i] * old->extent);
+    }
+    *newType = createDatatype(blocks, blockCount, extent);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Type_commit(MIMPI_Datatype* type) {
+    struct Datatype* t = findDatatype(*type);
+    if (t == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    if (t->committed == 1) {
+        return MIMPI_SUCCESS;
+    }
+
+    // Blocks were merged when they were appended, the memory is trimmed to them:
+    t->blocks = (struct TypeBlock*)realloc(t->blocks, MAX(t->blockCount, 1) * sizeof(struct TypeBlock));
+    if (t->blocks == NULL) {
+        perror("Memory allocation error in blocks");
+        exit(EXIT_FAILURE);
     }
 
-    // Right child:
-    if(rightChild != -1) {
-        // Send message:
-        messBuffer[511] = result;
-        passedInfo = 0;
-        while(passedInfo != 512) {
-            passedInfo = (int)chsend(gWriteDesc[2], messBuffer, 512);
+    // Vectors and other regular layouts are copied without looking at every block:
+    t->stride = 0;
+    if (t->blockCount >= 2) {
+        long stride = t->blocks[1].offset - t->blocks[0].offset;
+        int regular = 1;
+        for(int i = 1; i < t->blockCount && regular == 1; ++i) {
+            regular = t->blocks[i].length == t->blocks[0].length && t->blocks[i].offset - t->blocks[i - 1].offset == stride;
+        }
+        if (regular == 1) {
+            t->stride = stride;
         }
     }
+    t->committed = 1;
+    return MIMPI_SUCCESS;
+}
 
-    // Get result:
-    if(result == 'g') {
-        return MIMPI_SUCCESS;
-    } else {
-        return MIMPI_ERROR_REMOTE_FINISHED;
+MIMPI_Retcode MIMPI_Type_free(MIMPI_Datatype* type) {
+    struct Datatype* t = findDatatype(*type);
+    if (t == NULL || *type <= MIMPI_DOUBLE) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
     }
+    free(t->blocks);
+    t->blocks = NULL;
+    *type = MIMPI_DATATYPE_NULL;
+    return MIMPI_SUCCESS;
 }
 
-MIMPI_Retcode MIMPI_Bcast( // (2log_2)
-        void *data,
-        int count,
-        int root
-) {
+int MIMPI_Type_size(MIMPI_Datatype type) {
+    struct Datatype* t = findDatatype(type);
+    return t == NULL ? -1 : t->size;
+}
 
-    // Exception:
-    if(root < 0 || root >= worldSize) {
+// Layout for sending count elements of the type (NULL if they are contiguous), returns -1 if it cannot be used.
+// The description is copied, so the array of datatypes may grow while the message is in flight.
+int typedLayout(MIMPI_Datatype type, int count, struct Datatype* layout, struct Datatype** used) {
+    struct Datatype* t = findDatatype(type);
+    if (t == NULL || t->committed == 0 || count < 0 || (long)count * t->size > INT_MAX) {
+        return -1;
+    }
+    *layout = *t;
+    *used = t->blockCount == 1 && t->blocks[0].offset == 0 && t->blocks[0].length == t->extent ? NULL : layout;
+    return count * t->size;
+}
+
+MIMPI_Retcode MIMPI_Send_type(void const *data, int count, MIMPI_Datatype type, int destination, int tag) {
+    struct Datatype layout;
+    struct Datatype* used;
+    int bytes = typedLayout(type, count, &layout, &used);
+    if (bytes == -1) {
         return MIMPI_ERROR_NO_SUCH_RANK;
     }
+    return sendTagged(data, bytes, used, destination, tag);
+}
 
-    // Declarations and initializations:
-    char messageBuffer[512] = {0};
-    char signalMessageBuffer[512] = {0};
+MIMPI_Retcode MIMPI_Recv_type(void *data, int count, MIMPI_Datatype type, int source, int tag) {
+    struct Datatype layout;
+    struct Datatype* used;
+    int bytes = typedLayout(type, count, &layout, &used);
+    if (bytes == -1) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    return recvTagged(data, bytes, used, source, tag, NULL);
+}
 
-    char result = 'g';
+// Layout of the buffers as one element of a datatype, with offsets from the first buffer, returns -1 if
+// the message is too long. Blocks of the layout have to be freed.
+int vectorLayout(const struct iovec* buffers, int bufferCount, struct Datatype* layout) {
+    layout->blocks = allocateBlocks(bufferCount);
+    layout->blockCount = 0;
+    layout->size = 0;
+    layout->extent = 0;
+    layout->committed = 1;
+    layout->stride = 0;
+    long size = 0;
+    for(int i = 0; i < bufferCount; ++i) {
+        if (buffers[i].iov_len == 0) {
+            continue;
+        }
+        size += buffers[i].iov_len;
+        if (buffers[i].iov_len > INT_MAX || size > INT_MAX) {
+            free(layout->blocks);
+            return -1;
+        }
+        long offset = (long)((intptr_t)buffers[i].iov_base - (intptr_t)buffers[0].iov_base);
+        struct TypeBlock* last = &layout->blocks[MAX(layout->blockCount - 1, 0)];
+        if (layout->blockCount > 0 && last->offset + last->length == offset) {
+            last->length += (int)buffers[i].iov_len;
+        } else {
+            layout->blocks[layout->blockCount].offset = offset;
+            layout->blocks[layout->blockCount].length = (int)buffers[i].iov_len;
+            layout->blockCount++;
+        }
+    }
+    layout->size = (int)size;
+    return layout->size;
+}
 
-    int leftIsOnPath = 0;
-    int rightIsOnPath = 0;
-    int passedInfo;
-    int currentNode;
+MIMPI_Retcode MIMPI_Sendv(const struct iovec* buffers, int bufferCount, int destination, int tag) {
+    struct Datatype layout;
+    if (bufferCount < 0 || vectorLayout(buffers, bufferCount, &layout) == -1) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    void const *data = bufferCount > 0 ? buffers[0].iov_base : NULL;
+    int contiguous = layout.blockCount == 0 || (layout.blockCount == 1 && layout.blocks[0].offset == 0);
+    MIMPI_Retcode result = sendTagged(data, layout.size, contiguous ? NULL : &layout, destination, tag);
+    free(layout.blocks);
+    return result;
+}
 
-    int remaining = count;
-    int senderMessageOffset = 0;
-    int receiverMessageOffset = 0;
-    int chunkSize;
+MIMPI_Retcode MIMPI_Recvv(const struct iovec* buffers, int bufferCount, int source, int tag) {
+    struct Datatype layout;
+    if (bufferCount < 0 || vectorLayout(buffers, bufferCount, &layout) == -1) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    void* data = bufferCount > 0 ? buffers[0].iov_base : NULL;
+    int contiguous = layout.blockCount == 0 || (layout.blockCount == 1 && layout.blocks[0].offset == 0);
+    MIMPI_Retcode result = recvTagged(data, layout.size, contiguous ? NULL : &layout, source, tag, NULL);
+    free(layout.blocks);
+    return result;
+}
 
-    // If we need to send / get more messages:
-    while(remaining > 0) {
+// Transfers with size_t counts are split into messages of bulkSegment bytes, the receiver splits them the same way.
+// Collective segments go through the shared segment when there is one, otherwise as whole messages over the
+// point-to-point channels of the world (the tree of group channels moves only 511 bytes per frame).
+
+MIMPI_Retcode MIMPI_Send_c(void const *data, size_t count, int destination, int tag) {
+    size_t offset = 0;
+    do {
+        int chunkSize = (int)MIN(count - offset, (size_t)bulkSegment);
+        MIMPI_Retcode result = sendTagged((const uint8_t*)data + offset, chunkSize, NULL, destination, tag);
+        if (result != MIMPI_SUCCESS) {
+            return result;
+        }
+        offset += chunkSize;
+        bulkSent += chunkSize;
+    } while (offset < count);
+    return MIMPI_SUCCESS;
+}
 
-        chunkSize = (remaining > 511) ? 511 : remaining;
+MIMPI_Retcode MIMPI_Recv_c(void *data, size_t count, int source, int tag) {
+    long wanted = tag;
+    size_t offset = 0;
+    do {
+        int chunkSize = (int)MIN(count - offset, (size_t)bulkSegment);
 
-        // Left child:
-        if(leftChild != -1) {
+        // Next segments have the tag of the first one (it may have matched MIMPI_ANY_TAG):
+        MIMPI_Retcode result = recvTagged((uint8_t*)data + offset, chunkSize, NULL, source, wanted, &wanted);
+        if (result != MIMPI_SUCCESS) {
+            return result;
+        }
+        offset += chunkSize;
+        bulkReceived += chunkSize;
+    } while (offset < count);
+    return MIMPI_SUCCESS;
+}
 
-            // Check if you lay on the path between the root of MIMPI_Bcast and the root of binary tree:
-            if(worldRank != root) {
-                currentNode = root;
-                while(currentNode != 0) {
-                    if(currentNode == leftChild) {
-                        leftIsOnPath = 1;
-                        break;
-                    }
-                    currentNode = (currentNode-1)/2;
-                }
-            }
+MIMPI_Retcode MIMPI_Bcast_c(void *data, size_t count, int root) {
+    if (root < 0 || root >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    size_t offset = 0;
+    do {
+        int chunkSize = (int)MIN(count - offset, (size_t)bulkSegment);
+        uint8_t* segment = (uint8_t*)data + offset;
+        MIMPI_Retcode result = sharedControl != NULL ? MIMPI_Bcast(segment, chunkSize, root)
+            : commCollective(&communicators[MIMPI_COMM_WORLD], root, NULL, 0, MIMPI_SUM, segment, chunkSize);
+        if (result != MIMPI_SUCCESS) {
+            return result;
+        }
+        offset += chunkSize;
+        bulkCollective += chunkSize;
+    } while (offset < count);
+    return MIMPI_SUCCESS;
+}
 
-            // Get message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                if(leftIsOnPath == 1) {
-                    passedInfo = (int)chrecv(gReadDesc[1], messageBuffer, 512);
-                } else {
-                    passedInfo = (int)chrecv(gReadDesc[1], signalMessageBuffer, 512);
-                }
-            }
+MIMPI_Retcode MIMPI_Reduce_c(void const *send_data, void *recv_data, size_t count, MIMPI_Op op, int root) {
+    if (root < 0 || root >= worldSize || !validOp(op)) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    size_t offset = 0;
+    do {
+        int chunkSize = (int)MIN(count - offset, (size_t)bulkSegment);
+        const uint8_t* segment = (const uint8_t*)send_data + offset;
+        void* target = worldRank == root ? (uint8_t*)recv_data + offset : recv_data;
+        MIMPI_Retcode result = sharedControl != NULL ? MIMPI_Reduce(segment, target, chunkSize, op, root)
+            : channelReduce(&communicators[MIMPI_COMM_WORLD], segment, target, chunkSize, op, root);
+        if (result != MIMPI_SUCCESS) {
+            return result;
+        }
+        offset += chunkSize;
+        bulkCollective += chunkSize;
+    } while (offset < count);
+    return MIMPI_SUCCESS;
+}
 
-            // Update result:
-            if(leftIsOnPath == 1) {
-                if(messageBuffer[511] != 'g') {
-                    result = 'd';
-                }
-                messageBuffer[511] = 0;
-            } else {
-                if(signalMessageBuffer[511] != 'g') {
-                    result = 'd';
-                }
-                signalMessageBuffer[511] = 0;
-            }
+void MIMPI_Bulk_progress(size_t* sent, size_t* received, size_t* collective) {
+    *sent = (size_t)atomic_load(&bulkSent);
+    *received = (size_t)atomic_load(&bulkReceived);
+    *collective = (size_t)atomic_load(&bulkCollective);
+}
 
+// Elementwise op on count elements of a predefined datatype (user operators get operand as their first argument):
+void applyTypedOp(uint8_t* result, const uint8_t* operand, int count, MIMPI_Datatype type, MIMPI_Op op) {
+    if (op >= USER_OP_FIRST) {
+        int length = count;
+        findUserOp(op)->function(operand, result, &length, &type);
+    } else if (type == MIMPI_INT) {
+        int* x = (int*)result;
+        const int* y = (const int*)operand;
+        for(int i = 0; i < count; ++i) {
+            x[i] = op == MIMPI_MAX ? MAX(x[i], y[i]) : op == MIMPI_MIN ? MIN(x[i], y[i]) : op == MIMPI_SUM ? x[i] + y[i] : x[i] * y[i];
         }
+    } else if (type == MIMPI_DOUBLE) {
+        double* x = (double*)result;
+        const double* y = (const double*)operand;
+        for(int i = 0; i < count; ++i) {
+            x[i] = op == MIMPI_MAX ? MAX(x[i], y[i]) : op == MIMPI_MIN ? MIN(x[i], y[i]) : op == MIMPI_SUM ? x[i] + y[i] : x[i] * y[i];
+        }
+    } else {
+        applyOp(result, operand, count, op);
+    }
+}
 
-        // Right child:
-        if(rightChild != -1) {
+// Prefix reduction by recursive doubling: in the round with distance d every process sends its partial result
+// (of ranks rank-2d+1 .. rank) to rank+d and combines the one of rank-d into it. The exclusive result gathers
+// the same messages without the own contribution. Every message starts with the status byte, so processes
+// above one that has finished learn about it.
+MIMPI_Retcode commScan(void const *send_data, void *recv_data, int count, MIMPI_Datatype type, MIMPI_Op op, MIMPI_Comm comm, int exclusive) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || type < MIMPI_BYTE || type > MIMPI_DOUBLE || count < 0 || !validOp(op)) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    flushAllCoalesced();
+
+    long tag = CONTEXT_TAG(c->context * 2 + 1, COLLECTIVE_TAG);
+    int bytes = count * datatypes[type].size;
+    uint8_t status = 0;
+    int hasPrefix = 0;
+
+    uint8_t* partial = (uint8_t *)malloc(1 + bytes);
+    uint8_t* received = (uint8_t *)malloc(1 + bytes);
+    uint8_t* prefix = (uint8_t *)malloc(MAX(bytes, 1));
+    if (partial == NULL || received == NULL || prefix == NULL) {
+        perror("Memory allocation error in scan");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(partial + 1, send_data, bytes);
 
-            // Check if you lay on the path between the root of MIMPI_Bcast and the root of binary tree:
-            if(worldRank != root) {
-                currentNode = root;
-                while(currentNode != 0) {
-                    if(currentNode == rightChild) {
-                        rightIsOnPath = 1;
-                        break;
-                    }
-                    currentNode = (currentNode-1)/2;
-                }
+    for(int distance = 1; distance < c->size; distance *= 2) {
+        if (c->rank + distance < c->size) {
+            partial[0] = status;
+            if (sendTagged(partial, 1 + bytes, NULL, c->worldRanks[c->rank + distance], tag) != MIMPI_SUCCESS) {
+                status = 1;
             }
-
-            // Get message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                if(rightIsOnPath == 1) {
-                    passedInfo = (int)chrecv(gReadDesc[2], messageBuffer, 512);
-                } else {
-                    passedInfo = (int)chrecv(gReadDesc[2], signalMessageBuffer, 512);
-                }
+        }
+        if (c->rank - distance >= 0) {
+            if (recvTagged(received, 1 + bytes, NULL, c->worldRanks[c->rank - distance], tag, NULL) != MIMPI_SUCCESS || received[0] != 0) {
+                status = 1;
+                continue;
             }
-
-            // Update result:
-            if(rightIsOnPath == 1) {
-                if(messageBuffer[511] != 'g') {
-                    result = 'd';
-                }
-                messageBuffer[511] = 0;
+            if (hasPrefix == 1) {
+                applyTypedOp(prefix, received + 1, count, type, op);
             } else {
-                if(signalMessageBuffer[511] != 'g') {
-                    result = 'd';
-                }
-                signalMessageBuffer[511] = 0;
+                memcpy(prefix, received + 1, bytes);
+                hasPrefix = 1;
             }
+            applyTypedOp(partial + 1, received + 1, count, type, op);
         }
+    }
 
-        // Parent (I am not the root of the tree):
-        if(parentNode != -1) {
+    if (exclusive == 0) {
+        memcpy(recv_data, partial + 1, bytes);
+    } else if (hasPrefix == 1) {
+        memcpy(recv_data, prefix, bytes);
+    }
 
-            // I am not the root of MIMPI_Bcast:
-            if(worldRank != root) {
+    free(partial);
+    free(received);
+    free(prefix);
+    return status == 0 ? MIMPI_SUCCESS : MIMPI_ERROR_REMOTE_FINISHED;
+}
 
-                // Send message:
-                if(leftIsOnPath == 1 || rightIsOnPath == 1) {
-                    messageBuffer[511] = result;
-                    passedInfo = 0;
-                    while (passedInfo != 512) {
-                        passedInfo = (int)chsend(gWriteDesc[0], messageBuffer, 512);
-                    }
+MIMPI_Retcode MIMPI_Scan(void const *send_data, void *recv_data, int count, MIMPI_Datatype type, MIMPI_Op op, MIMPI_Comm comm) {
+    return commScan(send_data, recv_data, count, type, op, comm, 0);
+}
 
-                } else {
-                    signalMessageBuffer[511] = result;
-                    passedInfo = 0;
-                    while (passedInfo != 512) {
-                        passedInfo = (int)chsend(gWriteDesc[0], signalMessageBuffer, 512);
-                    }
-                }
+MIMPI_Retcode MIMPI_Exscan(void const *send_data, void *recv_data, int count, MIMPI_Datatype type, MIMPI_Op op, MIMPI_Comm comm) {
+    return commScan(send_data, recv_data, count, type, op, comm, 1);
+}
 
-            // I am the root of MIMPI_Bcast:
-            } else {
+MIMPI_Retcode MIMPI_Op_create(MIMPI_User_function* function, bool commute, MIMPI_Op* op) {
+    if (function == NULL) {
+        *op = MIMPI_OP_NULL;
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
 
-                // Create message:
-                messageBuffer[511] = result;
-                memcpy(messageBuffer, data + senderMessageOffset, chunkSize);
-                senderMessageOffset += chunkSize;
+    int index = 0;
+    while (index < userOpCount && userOps[index].function != NULL) {
+        index++;
+    }
+    if (index == userOpCount) {
+        userOps = (struct UserOp*)realloc(userOps, (userOpCount + 1) * sizeof(struct UserOp));
+        if (userOps == NULL) {
+            perror("Memory allocation error in userOps");
+            exit(EXIT_FAILURE);
+        }
+        userOpCount++;
+    }
+    userOps[index].function = function;
+    userOps[index].commute = commute;
+    *op = (MIMPI_Op)(USER_OP_FIRST + index);
+    return MIMPI_SUCCESS;
+}
 
-                // Send message:
-                passedInfo = 0;
-                while(passedInfo != 512) {
-                    passedInfo = (int)chsend(gWriteDesc[0], messageBuffer, 512);
-                }
+MIMPI_Retcode MIMPI_Op_free(MIMPI_Op* op) {
+    struct UserOp* u = findUserOp(*op);
+    if (u == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    u->function = NULL;
+    *op = MIMPI_OP_NULL;
+    return MIMPI_SUCCESS;
+}
 
-            }
+struct Request* findRequest(MIMPI_Request request) {
+    if (request < 0 || request >= requestCount) {
+        return NULL;
+    }
+    return requests[request];
+}
 
-            // Get message:
-            passedInfo = 0;
-            while (passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[0], messageBuffer, 512);
-            }
-            result = messageBuffer[511];
+// Sets everything that does not change between starts of the request.
+void fillRequest(struct Request* r, int receive, void *data, int count, int peer, long tag) {
+    r->receive = receive;
+    r->data = data;
+    r->count = count;
+    r->peer = peer;
+    r->tag = tag;
+    r->header[FRAME_TYPE] = 'm';
+    encodeTag(r->header, r->tag);
+    encodeNumber(r->header, FRAME_COUNT_FIRST, FRAME_COUNT_LAST, count);
+}
 
-        // I am the root of the tree:
-        } else {
-            // I am the root of MIMPI_Bcast:
-            if(worldRank == root) {
-                // Create message:
-                messageBuffer[511] = result;
-                memcpy(messageBuffer, data + senderMessageOffset, chunkSize);
-                senderMessageOffset += chunkSize;
-            }
+// Returns the handle of a new request with everything that does not change between its starts.
+MIMPI_Retcode createRequest(int receive, void *data, int count, int peer, int tag, MIMPI_Request* request) {
+    *request = MIMPI_REQUEST_NULL;
+    if(peer == worldRank) {
+        return MIMPI_ERROR_ATTEMPTED_SELF_OP;
+    } else if (peer < 0 || peer >= worldSize) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    startReceiver(peer);
+
+    struct Request* r = (struct Request*)calloc(1, sizeof(struct Request));
+    if (r == NULL) {
+        perror("Memory allocation error in request");
+        exit(EXIT_FAILURE);
+    }
+    fillRequest(r, receive, data, count, peer, tag);
+    r->posted.data = data;
+    r->posted.type = NULL;
+    ASSERT_ZERO(pthread_cond_init(&r->posted.cond, NULL));
+
+    int handle = 0;
+    while (handle < requestCount && requests[handle] != NULL) {
+        handle++;
+    }
+    if (handle == requestCount) {
+        requests = (struct Request**)realloc(requests, (requestCount + 1) * sizeof(struct Request*));
+        if (requests == NULL) {
+            perror("Memory allocation error in requests");
+            exit(EXIT_FAILURE);
+        }
+        requestCount++;
+    }
+    requests[handle] = r;
+    *request = handle;
+    return MIMPI_SUCCESS;
+}
+
+// Puts the started send at the end of the queue of its destination, it is pending until the writer takes it
+// (queueMutex has to be held).
+void queueRequest(struct Request* r) {
+    struct QueuedSend* entry = (struct QueuedSend*)malloc(sizeof(struct QueuedSend));
+    if (entry == NULL) {
+        perror("Memory allocation error in queued send");
+        exit(EXIT_FAILURE);
+    }
+    entry->data = r->data;
+    entry->count = r->count;
+    entry->tag = r->tag;
+    entry->attached = 0;
+    entry->request = r;
+    entry->next = NULL;
+
+    ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+    r->pending = 1;
+    ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+    appendToQueue(r->peer, entry);
+}
+
+// Sends the message of the request like sendTagged, with the header frame encoded once.
+// Below MIMPI_THREAD_MULTIPLE started receives wait for MIMPI_Wait, so nothing would clear a request to send of
+// the destination while we wait for ours. Such a send only writes the request, the payload writer does the rest.
+MIMPI_Retcode startSend(struct Request* r) {
+    if (finalFlags[r->peer] == 1) {
+        return MIMPI_ERROR_REMOTE_FINISHED;
+    }
+    recordSent(r->peer, r->count, r->tag);
+
+    int pend = threadLevel != MIMPI_THREAD_MULTIPLE && eagerCredit > 0;
+    if (queueBudget > 0 && pend == 0) {
+        return queueSend(r->data, r->count, NULL, r->peer, r->tag, 0);
+    }
 
+    // Queued messages go first. Their writer may wait for our receives as well, then the send waits in the queue:
+    if (sendQueues != NULL) {
+        ASSERT_ZERO(pthread_mutex_lock(&queueMutex));
+        if (pend == 1 && (sendQueues[r->peer].head != NULL || sendQueues[r->peer].busy == 1)) {
+            queueRequest(r);
+            ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+            return MIMPI_SUCCESS;
         }
+        waitForQueue(r->peer);
+        ASSERT_ZERO(pthread_mutex_unlock(&queueMutex));
+    }
 
-        // I am not the root of MIMPI_Bcast:
-        if(worldRank != root) {
-            // Save message:
-            memcpy(data + receiverMessageOffset, messageBuffer, chunkSize);
-            receiverMessageOffset += chunkSize;
+    lockSend(r->peer);
+    if (eagerCredit > 0 && r->count > atomic_load(&sendCredits[r->peer])) {
+        unlockSend(r->peer);
+        if (pend == 1) {
+            return pendPayload(r);
         }
+        return sendRendezvous(r->data, r->count, NULL, r->peer, r->tag);
+    }
+    MIMPI_Retcode result = sendMessage(r->data, r->count, NULL, r->peer, r->tag, r->header);
+    unlockSend(r->peer);
+    return result;
+}
 
-        // Left child:
-        if(leftChild != -1) {
+// With MIMPI_THREAD_MULTIPLE the receive is posted, so the receiver thread writes the message straight to data.
+// Otherwise it is done by the wait.
+void startRecv(struct Request* r) {
+    if (threadLevel != MIMPI_THREAD_MULTIPLE) {
+        return;
+    }
+    r->posted.parameters.count = r->count;
+    r->posted.parameters.tag = r->tag;
+    lockPeer(r->peer);
+    postReceive(&r->posted, r->peer);
+    unlockPeer(r->peer);
+}
 
-            // Send message:
-            messageBuffer[511] = result;
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[1], messageBuffer, 512);
-            }
+// Does the started receives below MIMPI_THREAD_MULTIPLE (before their waits), pending sends do not need us.
+void receiveStarted() {
+    for(int i = 0; i < requestCount; ++i) {
+        struct Request* r = requests[i];
+        if (r != NULL && r->receive == 1 && r->active == 1 && r->received == 0) {
+            r->result = recvTagged(r->data, r->count, NULL, r->peer, r->tag, NULL);
+            r->received = 1;
         }
+    }
+}
 
-        // Right child:
-        if(rightChild != -1) {
+MIMPI_Retcode waitRequest(struct Request* r) {
+    if (r->active == 0) {
+        return MIMPI_SUCCESS;
+    }
+    r->active = 0;
 
-            // Send message:
-            messageBuffer[511] = result;
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[2], messageBuffer, 512);
-            }
+    if (r->receive == 0) {
+        if (eagerCredit == 0) {
+            return r->result;
         }
 
-        remaining -= chunkSize;
+        // The destination may clear our request to send only after it gets what our started receives wait for:
+        ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+        if (r->pending == 1) {
+            ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+            receiveStarted();
+            ASSERT_ZERO(pthread_mutex_lock(&clearanceMutex));
+        }
+        while (r->pending == 1) {
+            ASSERT_ZERO(pthread_cond_wait(&clearanceCond, &clearanceMutex));
+        }
+        MIMPI_Retcode result = r->result;
+        ASSERT_ZERO(pthread_mutex_unlock(&clearanceMutex));
+        return result;
+    } else if (r->received == 1) {
+        r->received = 0;
+        return r->result;
+    } else if (threadLevel != MIMPI_THREAD_MULTIPLE) {
+        return recvTagged(r->data, r->count, NULL, r->peer, r->tag, NULL);
     }
 
-    // Get result:
-    if(result == 'g') {
-        return MIMPI_SUCCESS;
-    } else {
-        return MIMPI_ERROR_REMOTE_FINISHED;
+    flushAllCoalesced();
+    lockPeer(r->peer);
+    waitPosted(&r->posted, r->peer);
+    unlockPeer(r->peer);
+    return r->posted.status;
+}
+
+void startRequest(struct Request* r) {
+    r->active = 1;
+    if (r->receive == 1) {
+        startRecv(r);
+        return;
+    }
+
+    // Payload writer sets the result of a pending send by itself:
+    r->result = MIMPI_SUCCESS;
+    MIMPI_Retcode result = startSend(r);
+    if (result != MIMPI_SUCCESS) {
+        r->result = result;
     }
 }
 
-MIMPI_Retcode MIMPI_Reduce( // (2log_2)
-        void const *send_data,
-        void *recv_data,
-        int count,
-        MIMPI_Op op,
-        int root
-)
-{
+MIMPI_Retcode MIMPI_Send_init(void const *data, int count, int destination, int tag, MIMPI_Request* request) {
+    return createRequest(0, (void *)data, count, destination, tag, request);
+}
 
-    // Exception:
-    if(root < 0 || root >= worldSize) {
-        return MIMPI_ERROR_NO_SUCH_RANK; /// no process with requested rank exists in the world (ROOT)
+MIMPI_Retcode MIMPI_Recv_init(void *data, int count, int source, int tag, MIMPI_Request* request) {
+    return createRequest(1, data, count, source, tag, request);
+}
+
+MIMPI_Retcode MIMPI_Startall(int count, MIMPI_Request* handles) {
+    for(int i = 0; i < count; ++i) {
+        struct Request* r = findRequest(handles[i]);
+        if (r == NULL || r->active == 1) {
+            return MIMPI_ERROR_NO_SUCH_RANK;
+        }
+
+        // The same request can not be started twice:
+        for(int j = 0; j < i; ++j) {
+            if (handles[j] == handles[i]) {
+                return MIMPI_ERROR_NO_SUCH_RANK;
+            }
+        }
     }
 
-    // Declarations and initializations:
-    uint8_t leftMessageBuffer[512] = {0};
-    uint8_t rightMessageBuffer[512] = {0};
-    uint8_t upperMessageBuffer[512] = {0};
+    // Receives go first, so a send that waits for its destination does not hold back our own receives:
+    for(int i = 0; i < count; ++i) {
+        struct Request* r = findRequest(handles[i]);
+        if (r->receive == 1) {
+            startRequest(r);
+        }
+    }
+    for(int i = 0; i < count; ++i) {
+        struct Request* r = findRequest(handles[i]);
+        if (r->receive == 0) {
+            startRequest(r);
+        }
+    }
+    return MIMPI_SUCCESS;
+}
 
-    char result = 'g';
+MIMPI_Retcode MIMPI_Start(MIMPI_Request* request) {
+    return MIMPI_Startall(1, request);
+}
 
-    int passedInfo;
-    int remaining = count;
-    int senderMessageOffset = 0;
-    int receiverMessageOffset = 0;
-    int chunkSize;
+MIMPI_Retcode MIMPI_Waitall(int count, MIMPI_Request* handles) {
+    MIMPI_Retcode result = MIMPI_SUCCESS;
+    for(int i = 0; i < count; ++i) {
+        struct Request* r = findRequest(handles[i]);
+        MIMPI_Retcode status = r == NULL ? MIMPI_ERROR_NO_SUCH_RANK : waitRequest(r);
+        if (result == MIMPI_SUCCESS) {
+            result = status;
+        }
+    }
+    return result;
+}
 
-    // If we need to send / get more messages:
-    while(remaining > 0) {
+MIMPI_Retcode MIMPI_Wait(MIMPI_Request* request) {
+    return MIMPI_Waitall(1, request);
+}
 
-        // Create message:
-        chunkSize = (remaining > 511) ? 511 : remaining;
-        memcpy(upperMessageBuffer, send_data + senderMessageOffset, chunkSize);
-        senderMessageOffset += chunkSize;
+MIMPI_Retcode MIMPI_Request_free(MIMPI_Request* request) {
+    struct Request* r = findRequest(*request);
+    if (r == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
 
-        // Left child:
-        if(leftChild != -1) {
-            // Get message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[1], leftMessageBuffer, 512);
-            }
-            // Update result:
-            if(leftMessageBuffer[511] != 'g') {
-                result = 'd';
+    // Started receive may be on the list of the source:
+    waitRequest(r);
+    ASSERT_ZERO(pthread_cond_destroy(&r->posted.cond));
+    free(r);
+    requests[*request] = NULL;
+    *request = MIMPI_REQUEST_NULL;
+    return MIMPI_SUCCESS;
+}
+
+// Pins the process to the core at position (modulo their number) in the list of cores it may run on. The list
+// is ordered so that cores sharing the L2 cache come one after another. Nothing changes if affinity is unknown.
+void pinToCore(int position) {
+    unsigned long allowed[CPU_MASK_WORDS] = {0};
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) == -1) {
+        return;
+    }
+
+    int order[CPU_MASK_WORDS * 64];
+    int placed[CPU_MASK_WORDS * 64] = {0};
+    int count = 0;
+    for(int cpu = 0; cpu < CPU_MASK_WORDS * 64; ++cpu) {
+        if ((allowed[cpu / 64] >> (cpu % 64) & 1) == 0 || placed[cpu] == 1) {
+            continue;
+        }
+        order[count++] = cpu;
+        placed[cpu] = 1;
+
+        // Cores in the list like "0-1,8-9" go right after it:
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index2/shared_cpu_list", cpu);
+        FILE* list = fopen(path, "r");
+        if (list == NULL) {
+            continue;
+        }
+        int first;
+        while (fscanf(list, "%d", &first) == 1) {
+            int last = first;
+            int separator = fgetc(list);
+            if (separator == '-' && fscanf(list, "%d", &last) == 1) {
+                separator = fgetc(list);
             }
-            leftMessageBuffer[511] = 0;
-            // Update message:
-            for(int i = 0; i < chunkSize; ++i) {
-                if(op == MIMPI_MAX) {
-                    upperMessageBuffer[i] = MAX(upperMessageBuffer[i], leftMessageBuffer[i]);
-                } else if (op == MIMPI_MIN) {
-                    upperMessageBuffer[i] = MIN(upperMessageBuffer[i], leftMessageBuffer[i]);
-                } else if (op == MIMPI_SUM) {
-                    upperMessageBuffer[i] = upperMessageBuffer[i] + leftMessageBuffer[i];
-                } else if (op == MIMPI_PROD) {
-                    upperMessageBuffer[i] = upperMessageBuffer[i] * leftMessageBuffer[i];
+            for(int sibling = first; sibling <= last && sibling < CPU_MASK_WORDS * 64; ++sibling) {
+                if ((allowed[sibling / 64] >> (sibling % 64) & 1) == 1 && placed[sibling] == 0) {
+                    order[count++] = sibling;
+                    placed[sibling] = 1;
                 }
             }
+            if (separator != ',') {
+                break;
+            }
+        }
+        fclose(list);
+    }
+    if (count == 0) {
+        return;
+    }
+
+    unsigned long target[CPU_MASK_WORDS] = {0};
+    int cpu = order[position % count];
+    target[cpu / 64] |= 1UL << (cpu % 64);
 
+    // Every thread has its own mask, receivers and writers that already run are moved too
+    // (threads started later get the mask of the thread that starts them):
+    DIR* tasks = opendir("/proc/self/task");
+    if (tasks == NULL) {
+        syscall(SYS_sched_setaffinity, 0, sizeof(target), target);
+        return;
+    }
+    struct dirent* task;
+    while ((task = readdir(tasks)) != NULL) {
+        if (task->d_name[0] != '.') {
+            syscall(SYS_sched_setaffinity, atoi(task->d_name), sizeof(target), target);
         }
+    }
+    ASSERT_SYS_OK(closedir(tasks));
+}
 
-        // Right child:
-        if(rightChild != -1) {
-            // Get message:
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[2], rightMessageBuffer, 512);
-            }
-            // Update result:
-            if(rightMessageBuffer[511] != 'g') {
-                result = 'd';
-            }
-            rightMessageBuffer[511] = 0;
-            // Update message:
-            for(int i = 0; i < chunkSize; ++i) {
-                if(op == MIMPI_MAX) {
-                    upperMessageBuffer[i] = MAX(upperMessageBuffer[i], rightMessageBuffer[i]);
-                } else if (op == MIMPI_MIN) {
-                    upperMessageBuffer[i] = MIN(upperMessageBuffer[i], rightMessageBuffer[i]);
-                } else if (op == MIMPI_SUM) {
-                    upperMessageBuffer[i] = upperMessageBuffer[i] + rightMessageBuffer[i];
-                } else if (op == MIMPI_PROD) {
-                    upperMessageBuffer[i] = upperMessageBuffer[i] * rightMessageBuffer[i];
-                }
-            }
+// Rank of the process disp places from rank in the dimension of a Cartesian communicator (MIMPI_PROC_NULL past
+// the edge of a dimension that is not periodic). Ranks go row by row, the last dimension changes fastest.
+int cartShift(struct Communicator* c, int rank, int dimension, int disp) {
+    int stride = 1;
+    for(int i = dimension + 1; i < c->dimCount; ++i) {
+        stride *= c->dims[i];
+    }
+    int size = c->dims[dimension];
+    int coord = rank / stride % size;
+    int moved = coord + disp;
+    if (c->periods[dimension] != 0) {
+        moved = ((moved % size) + size) % size;
+    } else if (moved < 0 || moved >= size) {
+        return MIMPI_PROC_NULL;
+    }
+    return rank + (moved - coord) * stride;
+}
+
+// Communicator of the same processes with the topology (it takes over dims, periods and neighbors).
+MIMPI_Retcode createTopology(MIMPI_Comm comm, int dimCount, int* dims, int* periods, int neighborCount, int* neighbors, bool reorder, MIMPI_Comm* newComm) {
+    MIMPI_Retcode result = MIMPI_Comm_dup(comm, newComm);
+    if (result != MIMPI_SUCCESS) {
+        free(dims);
+        free(periods);
+        free(neighbors);
+        return result;
+    }
+    struct Communicator* c = findCommunicator(*newComm);
+    c->dimCount = dimCount;
+    c->dims = dims;
+    c->periods = periods;
+    c->neighborCount = neighborCount;
+    c->neighbors = neighbors;
+
+    // Consecutive world ranks (neighbors in the last dimension of a grid of the world) get cores that share
+    // caches. Ranks in a split communicator repeat across groups, so they would put several processes on one core:
+    if (reorder && pinned == 0) {
+        pinToCore(worldRank);
+        pinned = 1;
+    }
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Cart_create(MIMPI_Comm comm, int ndims, int const *dims, int const *periods, bool reorder, MIMPI_Comm* newComm) {
+    *newComm = MIMPI_COMM_NULL;
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || ndims < 1) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    long nodes = 1;
+    for(int i = 0; i < ndims; ++i) {
+        nodes *= dims[i] < 1 ? 0 : dims[i];
+    }
+    if (nodes != c->size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    struct Communicator grid = *c;
+    grid.dimCount = ndims;
+    grid.dims = (int *)malloc(ndims * sizeof(int));
+    grid.periods = (int *)malloc(ndims * sizeof(int));
+    grid.neighbors = (int *)malloc(2 * ndims * sizeof(int));
+    if (grid.dims == NULL || grid.periods == NULL || grid.neighbors == NULL) {
+        perror("Memory allocation error in MIMPI_Cart_create");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(grid.dims, dims, ndims * sizeof(int));
+    memcpy(grid.periods, periods, ndims * sizeof(int));
+
+    // The one below, then the one above, in every dimension:
+    for(int i = 0; i < ndims; ++i) {
+        grid.neighbors[2 * i] = cartShift(&grid, c->rank, i, -1);
+        grid.neighbors[2 * i + 1] = cartShift(&grid, c->rank, i, 1);
+    }
+    return createTopology(comm, ndims, grid.dims, grid.periods, 2 * ndims, grid.neighbors, reorder, newComm);
+}
+
+MIMPI_Retcode MIMPI_Cart_coords(MIMPI_Comm comm, int rank, int maxdims, int* coords) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || c->dims == NULL || rank < 0 || rank >= c->size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    for(int i = c->dimCount - 1; i >= 0; --i) {
+        if (i < maxdims) {
+            coords[i] = rank % c->dims[i];
         }
+        rank /= c->dims[i];
+    }
+    return MIMPI_SUCCESS;
+}
 
-        // Parent (I am not the root of the tree):
-        if(parentNode != -1) {
-            // Update result:
-            upperMessageBuffer[511] = result;
-            // Send message:
-            passedInfo = 0;
-            while (passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[0], upperMessageBuffer, 512);
-            }
-            // Get message:
-            passedInfo = 0;
-            while (passedInfo != 512) {
-                passedInfo = (int)chrecv(gReadDesc[0], upperMessageBuffer, 512);
-            }
-            // Update result:
-            result = (char)upperMessageBuffer[511];
+MIMPI_Retcode MIMPI_Cart_rank(MIMPI_Comm comm, int const *coords, int* rank) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || c->dims == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    *rank = 0;
+    for(int i = 0; i < c->dimCount; ++i) {
+        int coord = coords[i];
+        if (c->periods[i] != 0) {
+            coord = ((coord % c->dims[i]) + c->dims[i]) % c->dims[i];
+        } else if (coord < 0 || coord >= c->dims[i]) {
+            return MIMPI_ERROR_NO_SUCH_RANK;
         }
+        *rank = *rank * c->dims[i] + coord;
+    }
+    return MIMPI_SUCCESS;
+}
 
-        // I am the root of MIMPI_Reduce:
-        if(worldRank == root) {
-            // Save message:
-            memcpy(recv_data + receiverMessageOffset, upperMessageBuffer, chunkSize);
-            receiverMessageOffset += chunkSize;
+MIMPI_Retcode MIMPI_Cart_shift(MIMPI_Comm comm, int direction, int disp, int* source, int* dest) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || c->dims == NULL || direction < 0 || direction >= c->dimCount) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    *source = cartShift(c, c->rank, direction, -disp);
+    *dest = cartShift(c, c->rank, direction, disp);
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Graph_create(MIMPI_Comm comm, int nnodes, int const *index, int const *edges, bool reorder, MIMPI_Comm* newComm) {
+    *newComm = MIMPI_COMM_NULL;
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || nnodes < 1 || nnodes != c->size) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+
+    // Ends of the lists of neighbors can not go back:
+    for(int i = 0; i < nnodes; ++i) {
+        if (index[i] < (i == 0 ? 0 : index[i - 1])) {
+            return MIMPI_ERROR_NO_SUCH_RANK;
+        }
+    }
+    for(int i = 0; i < index[nnodes - 1]; ++i) {
+        if (edges[i] < 0 || edges[i] >= nnodes) {
+            return MIMPI_ERROR_NO_SUCH_RANK;
         }
+    }
 
-        // Left child:
-        if(leftChild != -1) {
-            // Send message
-            upperMessageBuffer[511] = result;
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[1], upperMessageBuffer, 512);
+    int first = c->rank == 0 ? 0 : index[c->rank - 1];
+    int neighborCount = index[c->rank] - first;
+    int* neighbors = (int *)malloc(MAX(neighborCount, 1) * sizeof(int));
+    if (neighbors == NULL) {
+        perror("Memory allocation error in neighbors");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(neighbors, edges + first, neighborCount * sizeof(int));
+    return createTopology(comm, 0, NULL, NULL, neighborCount, neighbors, reorder, newComm);
+}
+
+MIMPI_Retcode MIMPI_Neighbors_count(MIMPI_Comm comm, int* count) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || c->neighbors == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    *count = c->neighborCount;
+    return MIMPI_SUCCESS;
+}
+
+MIMPI_Retcode MIMPI_Neighbors(MIMPI_Comm comm, int maxneighbors, int* neighbors) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || c->neighbors == NULL) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    memcpy(neighbors, c->neighbors, MIN(maxneighbors, c->neighborCount) * sizeof(int));
+    return MIMPI_SUCCESS;
+}
+
+// Tag of the message in the slot of a neighbor. A Cartesian process sends to the one below with the tag of its
+// slot, so the one below expects it in its slot of the one above (the other slot of the pair), and the other
+// way round. Messages between graph neighbors are matched in order.
+long neighborTag(struct Communicator* c, int slot, int receiving) {
+    int offset = c->dims == NULL ? 0 : (receiving == 1 ? slot ^ 1 : slot);
+    return CONTEXT_TAG(c->context * 2 + 1, NEIGHBOR_TAG + offset);
+}
+
+// Block sent to the neighbor in slot and the one received from it are count bytes at slot*count (send block is
+// all of send_data without alltoall). With MIMPI_THREAD_MULTIPLE all receives are posted before anything is sent,
+// so receiver threads write blocks straight to recv_data while this thread sends. A process that is its own
+// neighbor copies the block.
+MIMPI_Retcode neighborExchange(void const *send_data, int count, void *recv_data, MIMPI_Comm comm, int alltoall) {
+    struct Communicator* c = findCommunicator(comm);
+    if (c == NULL || c->neighbors == NULL || count < 0) {
+        return MIMPI_ERROR_NO_SUCH_RANK;
+    }
+    flushAllCoalesced();
+
+    MIMPI_Retcode result = MIMPI_SUCCESS;
+    int slots = c->neighborCount;
+    struct PostedReceive* posted = NULL;
+    struct Request* sends = NULL;
+    if (threadLevel != MIMPI_THREAD_MULTIPLE) {
+        // Receives come after the sends, which must not wait for them (like started persistent sends):
+        sends = (struct Request *)calloc(MAX(slots, 1), sizeof(struct Request));
+        if (sends == NULL) {
+            perror("Memory allocation error in sends");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        posted = (struct PostedReceive *)malloc(MAX(slots, 1) * sizeof(struct PostedReceive));
+        if (posted == NULL) {
+            perror("Memory allocation error in posted");
+            exit(EXIT_FAILURE);
+        }
+        for(int slot = 0; slot < slots; ++slot) {
+            int neighbor = c->neighbors[slot];
+            if (neighbor == MIMPI_PROC_NULL || neighbor == c->rank) {
+                continue;
             }
+            int source = c->worldRanks[neighbor];
+            startReceiver(source);
+            posted[slot].parameters.count = count;
+            posted[slot].parameters.tag = neighborTag(c, slot, 1);
+            posted[slot].data = (uint8_t*)recv_data + (long)slot * count;
+            posted[slot].type = NULL;
+            ASSERT_ZERO(pthread_cond_init(&posted[slot].cond, NULL));
+            lockPeer(source);
+            postReceive(&posted[slot], source);
+            unlockPeer(source);
         }
+    }
 
-        //Right child:
-        if(rightChild != -1) {
-            // Send message
-            upperMessageBuffer[511] = result;
-            passedInfo = 0;
-            while(passedInfo != 512) {
-                passedInfo = (int)chsend(gWriteDesc[2], upperMessageBuffer, 512);
-            }
+    // Blocks to every neighbor:
+    for(int slot = 0; slot < slots; ++slot) {
+        int neighbor = c->neighbors[slot];
+        const uint8_t* block = alltoall == 1 ? (const uint8_t*)send_data + (long)slot * count : send_data;
+        if (neighbor == MIMPI_PROC_NULL) {
+            continue;
+        } else if (neighbor == c->rank) {
+            int mirror = c->dims == NULL ? slot : slot ^ 1;
+            const uint8_t* own = alltoall == 1 ? (const uint8_t*)send_data + (long)mirror * count : send_data;
+            memcpy((uint8_t*)recv_data + (long)slot * count, own, count);
+        } else if (sends != NULL) {
+            int destination = c->worldRanks[neighbor];
+            startReceiver(destination);
+            fillRequest(&sends[slot], 0, (void *)block, count, destination, neighborTag(c, slot, 0));
+            startRequest(&sends[slot]);
+        } else if (sendTagged(block, count, NULL, c->worldRanks[neighbor], neighborTag(c, slot, 0)) != MIMPI_SUCCESS) {
+            result = MIMPI_ERROR_REMOTE_FINISHED;
         }
+    }
 
-        remaining -= chunkSize;
+    // Blocks from every neighbor:
+    for(int slot = 0; slot < slots; ++slot) {
+        int neighbor = c->neighbors[slot];
+        if (neighbor == MIMPI_PROC_NULL || neighbor == c->rank) {
+            continue;
+        }
+        int source = c->worldRanks[neighbor];
+        MIMPI_Retcode status;
+        if (posted != NULL) {
+            lockPeer(source);
+            waitPosted(&posted[slot], source);
+            unlockPeer(source);
+            ASSERT_ZERO(pthread_cond_destroy(&posted[slot].cond));
+            status = posted[slot].status;
+        } else {
+            status = recvTagged((uint8_t*)recv_data + (long)slot * count, count, NULL, source, neighborTag(c, slot, 1), NULL);
+        }
+        if (result == MIMPI_SUCCESS) {
+            result = status;
+        }
     }
 
-    // Get result:
-    if(result == 'g') {
-        return MIMPI_SUCCESS;
-    } else {
-        return MIMPI_ERROR_REMOTE_FINISHED;
+    // Pending sends end once their destinations have received them:
+    for(int slot = 0; sends != NULL && slot < slots; ++slot) {
+        MIMPI_Retcode status = waitRequest(&sends[slot]);
+        if (status != MIMPI_SUCCESS) {
+            result = MIMPI_ERROR_REMOTE_FINISHED;
+        }
     }
-}
\ No newline at end of file
+
+    free(posted);
+    free(sends);
+    return result;
+}
+
+MIMPI_Retcode MIMPI_Neighbor_allgather(void const *send_data, int count, void *recv_data, MIMPI_Comm comm) {
+    return neighborExchange(send_data, count, recv_data, comm, 0);
+}
+
+MIMPI_Retcode MIMPI_Neighbor_alltoall(void const *send_data, int count, void *recv_data, MIMPI_Comm comm) {
+    return neighborExchange(send_data, count, recv_data, comm, 1);
+}
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 _Noreturn void syserr(const char* fmt, ...)
@@ -44,3 +45,18 @@ _Noreturn void fatal(const char* fmt, ...)
 /////////////////////////////////////////////////
 // Put your implementation here
 
+int getEnvInt(const char* name, int defaultValue)
+{
+    char* value = getenv(name);
+    if (value == NULL || *value == '\0') {
+        return defaultValue;
+    }
+    return (int)strtol(value, NULL, 10);
+}
+
+long elapsedMicroseconds(const struct timespec* since)
+{
+    struct timespec now;
+    ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (now.tv_sec - since->tv_sec) * 1000000L + (now.tv_nsec - since->tv_nsec) / 1000L;
+}
@@ -9,6 +9,8 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdnoreturn.h>
+#include <sys/uio.h>
+#include <time.h>
 
 /*
     Assert that expression doesn't evaluate to -1 (as almost every system function does in case of error).
@@ -48,8 +50,250 @@ _Noreturn extern void fatal(const char* fmt, ...);
 /////////////////////////////////////////////
 // Put your declarations here
 
+#include "mimpi.h"
 
+/* Levels of thread support for MIMPI_Init_thread. */
+#define MIMPI_THREAD_SINGLE 0
+#define MIMPI_THREAD_FUNNELED 1
+#define MIMPI_THREAD_SERIALIZED 2
+#define MIMPI_THREAD_MULTIPLE 3
 
+/* Reads integer environment variable, returns defaultValue if it is not set. */
+extern int getEnvInt(const char* name, int defaultValue);
 
+/* Microseconds of the monotonic clock that have passed since the given time. */
+extern long elapsedMicroseconds(const struct timespec* since);
+
+/*
+    Like MIMPI_Init, with requested level of thread support. With MIMPI_THREAD_MULTIPLE many threads
+    may call point-to-point functions at the same time (collectives still have to be called by one thread,
+    deadlock detection is off then, a thread that waits does not mean that the process will not send).
+    Level that is actually provided is stored in provided.
+*/
+void MIMPI_Init_thread(bool enable_deadlock_detection, int required, int* provided);
+
+/*
+    Sends at once all small messages for destination that were packed together by coalescing
+    (enabled with MIMPI_COALESCE_BYTES environment variable). Without it they go when the buffer fills up,
+    or MIMPI_COALESCE_USEC (1000 by default) after the first of them, even if the process makes no calls.
+*/
+MIMPI_Retcode MIMPI_Flush(int destination);
+
+/*
+    Like MIMPI_Send, but the message is copied and written to the destination by a background thread,
+    so the call does not wait for the pipe. Copies take space from the budget set with MIMPI_Buffer_attach
+    (and wait for it if it is used up). Without an attached buffer the message is sent right away.
+*/
+MIMPI_Retcode MIMPI_Bsend(void const *data, int count, int destination, int tag);
+
+/*
+    Sets the space for messages of MIMPI_Bsend to size bytes. Copies are allocated by the library,
+    the buffer is only given back by MIMPI_Buffer_detach.
+*/
+MIMPI_Retcode MIMPI_Buffer_attach(void* buffer, int size);
+
+/* Waits until all messages of MIMPI_Bsend are written and returns the attached buffer and its size. */
+MIMPI_Retcode MIMPI_Buffer_detach(void** buffer, int* size);
+
+/*
+    Communicators: groups of processes with their own ranks (0 .. size-1), tags and collective trees.
+    MIMPI_COMM_WORLD has all processes with their world ranks. Messages sent in one communicator
+    are received only in that communicator, collectives of different communicators run independently.
+*/
+typedef int MIMPI_Comm;
+
+#define MIMPI_COMM_WORLD 0
+#define MIMPI_COMM_NULL (-1)
+#define MIMPI_UNDEFINED (-1)    /* color of processes that do not join any new communicator */
+
+/* Size of the communicator and rank of this process in it (-1 for an invalid communicator). */
+int MIMPI_Comm_size(MIMPI_Comm comm);
+int MIMPI_Comm_rank(MIMPI_Comm comm);
+
+/*
+    Collective over comm: processes with the same color get a new communicator, ranked by key
+    (ties by the rank in comm). With color MIMPI_UNDEFINED newComm is MIMPI_COMM_NULL. A process may have
+    4999 communicators besides MIMPI_COMM_WORLD at once (freed ones do not count), past that the call gives
+    MIMPI_ERROR_NO_SUCH_RANK to all processes of comm.
+*/
+MIMPI_Retcode MIMPI_Comm_split(MIMPI_Comm comm, int color, int key, MIMPI_Comm* newComm);
+
+/* Collective over comm: new communicator with the same processes and ranks. */
+MIMPI_Retcode MIMPI_Comm_dup(MIMPI_Comm comm, MIMPI_Comm* newComm);
+
+/* Frees the communicator (not MIMPI_COMM_WORLD) and sets it to MIMPI_COMM_NULL. */
+MIMPI_Retcode MIMPI_Comm_free(MIMPI_Comm* comm);
+
+/* Point-to-point and collective functions with ranks of the communicator. */
+MIMPI_Retcode MIMPI_Comm_send(void const *data, int count, int destination, int tag, MIMPI_Comm comm);
+MIMPI_Retcode MIMPI_Comm_recv(void *data, int count, int source, int tag, MIMPI_Comm comm);
+MIMPI_Retcode MIMPI_Comm_barrier(MIMPI_Comm comm);
+MIMPI_Retcode MIMPI_Comm_bcast(void *data, int count, int root, MIMPI_Comm comm);
+MIMPI_Retcode MIMPI_Comm_reduce(void const *send_data, void *recv_data, int count, MIMPI_Op op, int root, MIMPI_Comm comm);
+
+/*
+    One-sided windows in the segment shared by all processes (needs MIMPI_SHM_BYTES for mimpirun).
+    Put, Get and Accumulate access memory of the target directly, offsets are in bytes. An access outside of
+    the part of the target, or a window without the segment or without room in it, gives MIMPI_ERROR_NO_SUCH_RANK.
+*/
+typedef int MIMPI_Win;
+
+#define MIMPI_WIN_NULL (-1)
+
+/* Collective: every process gets size bytes (zeroed) of the window at base. */
+MIMPI_Retcode MIMPI_Win_create(int size, void** base, MIMPI_Win* win);
+
+/* Collective: frees the window and sets it to MIMPI_WIN_NULL. */
+MIMPI_Retcode MIMPI_Win_free(MIMPI_Win* win);
+
+MIMPI_Retcode MIMPI_Put(void const *data, int count, int target, int offset, MIMPI_Win win);
+MIMPI_Retcode MIMPI_Get(void *data, int count, int target, int offset, MIMPI_Win win);
+
+/* Combines data into the memory of the target with op, atomically with other accumulates. */
+MIMPI_Retcode MIMPI_Accumulate(void const *data, int count, MIMPI_Op op, int target, int offset, MIMPI_Win win);
+
+/* Collective: accesses made before the fence are visible to everyone after it. */
+MIMPI_Retcode MIMPI_Win_fence(MIMPI_Win win);
+
+/* Exclusive access to the memory of the target (between other processes that lock it). */
+MIMPI_Retcode MIMPI_Win_lock(int target, MIMPI_Win win);
+MIMPI_Retcode MIMPI_Win_unlock(int target, MIMPI_Win win);
+
+/*
+    Datatypes: layout of one element in memory, messages of count elements carry only the bytes of the layout
+    (count * MIMPI_Type_size), so a receive with any type of the same size matches. Derived types can be used
+    as old types right away, in sends and receives after MIMPI_Type_commit.
+*/
+typedef int MIMPI_Datatype;
+
+#define MIMPI_BYTE 0
+#define MIMPI_INT 1
+#define MIMPI_DOUBLE 2
+#define MIMPI_DATATYPE_NULL (-1)
+
+/* count blocks of blockLength elements of oldType, starts of the blocks are stride elements apart. */
+MIMPI_Retcode MIMPI_Type_vector(int count, int blockLength, int stride, MIMPI_Datatype oldType, MIMPI_Datatype* newType);
+
+/* Blocks of blockLengths[i] elements of oldType at displacements[i] elements from the start. */
+MIMPI_Retcode MIMPI_Type_indexed(int count, int const *blockLengths, int const *displacements, MIMPI_Datatype oldType, MIMPI_Datatype* newType);
+
+/* Blocks of blockLengths[i] elements of types[i] at displacements[i] bytes from the start. */
+MIMPI_Retcode MIMPI_Type_struct(int count, int const *blockLengths, long const *displacements, MIMPI_Datatype const *types, MIMPI_Datatype* newType);
+
+/* Compacts the layout for sending and receiving. */
+MIMPI_Retcode MIMPI_Type_commit(MIMPI_Datatype* type);
+
+/* Frees a derived type and sets it to MIMPI_DATATYPE_NULL (types built from it stay valid). */
+MIMPI_Retcode MIMPI_Type_free(MIMPI_Datatype* type);
+
+/* Bytes sent for one element (-1 for an invalid type). */
+int MIMPI_Type_size(MIMPI_Datatype type);
+
+/* MIMPI_Send and MIMPI_Recv of count elements of the type, gathered from and scattered to data. */
+MIMPI_Retcode MIMPI_Send_type(void const *data, int count, MIMPI_Datatype type, int destination, int tag);
+MIMPI_Retcode MIMPI_Recv_type(void *data, int count, MIMPI_Datatype type, int source, int tag);
+
+/*
+    Buffers presented as one message: its bytes are the buffers one after another, so it matches a send
+    or a receive of the same total size. Large buffers are written straight from their memory.
+*/
+MIMPI_Retcode MIMPI_Sendv(const struct iovec* buffers, int bufferCount, int destination, int tag);
+MIMPI_Retcode MIMPI_Recvv(const struct iovec* buffers, int bufferCount, int source, int tag);
+
+/*
+    Versions with size_t counts, for buffers beyond 2 GB. Data goes in messages of MIMPI_BULK_SEGMENT_BYTES
+    (256 MiB by default), so sender and receiver have to use the same call. Messages of one transfer have the tag
+    the first one has matched.
+*/
+MIMPI_Retcode MIMPI_Send_c(void const *data, size_t count, int destination, int tag);
+MIMPI_Retcode MIMPI_Recv_c(void *data, size_t count, int source, int tag);
+MIMPI_Retcode MIMPI_Bcast_c(void *data, size_t count, int root);
+MIMPI_Retcode MIMPI_Reduce_c(void const *send_data, void *recv_data, size_t count, MIMPI_Op op, int root);
+
+/* Bytes moved so far by the calls above: sent, received and combined or broadcast in collectives. */
+void MIMPI_Bulk_progress(size_t* sent, size_t* received, size_t* collective);
+
+/*
+    Collective over comm: prefix reductions of count elements of a predefined datatype (MIMPI_BYTE, MIMPI_INT
+    or MIMPI_DOUBLE), combined with op as numbers of that type. Process of rank i gets the result for ranks 0 .. i
+    (MIMPI_Scan) or 0 .. i-1 (MIMPI_Exscan, recv_data of rank 0 is left as it is), in log2(size) rounds.
+*/
+MIMPI_Retcode MIMPI_Scan(void const *send_data, void *recv_data, int count, MIMPI_Datatype type, MIMPI_Op op, MIMPI_Comm comm);
+MIMPI_Retcode MIMPI_Exscan(void const *send_data, void *recv_data, int count, MIMPI_Datatype type, MIMPI_Op op, MIMPI_Comm comm);
+
+/*
+    User reduction operators, usable wherever a MIMPI_Op is taken. The function combines *len elements of *type
+    as inout[i] = in[i] op inout[i] (bytes of MIMPI_BYTE in functions that count bytes), where in comes from lower
+    ranks. It is called on whole buffers, in MIMPI_Reduce_c on segments of MIMPI_BULK_SEGMENT_BYTES. Reductions with
+    an operator that is not commutative combine the contributions in rank order.
+*/
+typedef void MIMPI_User_function(void const *in, void *inout, int *len, MIMPI_Datatype *type);
+
+#define MIMPI_OP_NULL ((MIMPI_Op)-1)
+
+MIMPI_Retcode MIMPI_Op_create(MIMPI_User_function* function, bool commute, MIMPI_Op* op);
+
+/* Frees the operator and sets it to MIMPI_OP_NULL. */
+MIMPI_Retcode MIMPI_Op_free(MIMPI_Op* op);
+
+/*
+    Persistent requests: a send or a receive set up once (arguments checked, header of the message encoded)
+    and started every time it is needed. Sends are done when started, with MIMPI_THREAD_MULTIPLE receives are
+    posted then and the receiver thread writes the message straight to data. Waits return the result of the
+    communication (success for a request that is not started).
+*/
+typedef int MIMPI_Request;
+
+#define MIMPI_REQUEST_NULL (-1)
+
+MIMPI_Retcode MIMPI_Send_init(void const *data, int count, int destination, int tag, MIMPI_Request* request);
+MIMPI_Retcode MIMPI_Recv_init(void *data, int count, int source, int tag, MIMPI_Request* request);
+
+/* Starts requests that are not started yet, receives before sends. */
+MIMPI_Retcode MIMPI_Start(MIMPI_Request* request);
+MIMPI_Retcode MIMPI_Startall(int count, MIMPI_Request* requests);
+
+/* Waits for started requests, returns the first error of them. */
+MIMPI_Retcode MIMPI_Wait(MIMPI_Request* request);
+MIMPI_Retcode MIMPI_Waitall(int count, MIMPI_Request* requests);
+
+/* Waits for the request if it is started, frees it and sets it to MIMPI_REQUEST_NULL. */
+MIMPI_Retcode MIMPI_Request_free(MIMPI_Request* request);
+
+/*
+    Topologies: communicators whose processes also know their neighbors. A Cartesian process has, in every
+    dimension, the neighbor below and the one above (MIMPI_PROC_NULL past the edge of a dimension that is not
+    periodic, transfers with it are skipped). Ranks go row by row, the last dimension changes fastest.
+    With reorder the process is pinned to a core (once, later topologies keep it there), consecutive world ranks
+    to cores that share caches.
+*/
+#define MIMPI_PROC_NULL (-2)
+
+/* Collective over comm: communicator with the same ranks in a grid of dims (their product is the size of comm). */
+MIMPI_Retcode MIMPI_Cart_create(MIMPI_Comm comm, int ndims, int const *dims, int const *periods, bool reorder, MIMPI_Comm* newComm);
+MIMPI_Retcode MIMPI_Cart_coords(MIMPI_Comm comm, int rank, int maxdims, int* coords);
+MIMPI_Retcode MIMPI_Cart_rank(MIMPI_Comm comm, int const *coords, int* rank);
+
+/* Ranks of the processes disp places below (source) and above (dest) this one in the dimension. */
+MIMPI_Retcode MIMPI_Cart_shift(MIMPI_Comm comm, int direction, int disp, int* source, int* dest);
+
+/*
+    Collective over comm: communicator with the same ranks where neighbors of rank i are edges[index[i-1]]
+    up to edges[index[i]-1] (from edges[0] for rank 0), so index can not decrease. Every edge has to be given
+    in both directions.
+*/
+MIMPI_Retcode MIMPI_Graph_create(MIMPI_Comm comm, int nnodes, int const *index, int const *edges, bool reorder, MIMPI_Comm* newComm);
+
+/* Number of neighbors and their ranks, in the order of blocks of neighbor collectives. */
+MIMPI_Retcode MIMPI_Neighbors_count(MIMPI_Comm comm, int* count);
+MIMPI_Retcode MIMPI_Neighbors(MIMPI_Comm comm, int maxneighbors, int* neighbors);
+
+/*
+    Collective over neighbors: recv_data gets count bytes from neighbor i at i*count. Allgather sends all of send_data
+    to every neighbor, alltoall sends block i (count bytes at i*count) to neighbor i. All transfers are in flight at
+    once, with MIMPI_THREAD_MULTIPLE receives are posted before anything is sent.
+*/
+MIMPI_Retcode MIMPI_Neighbor_allgather(void const *send_data, int count, void *recv_data, MIMPI_Comm comm);
+MIMPI_Retcode MIMPI_Neighbor_alltoall(void const *send_data, int count, void *recv_data, MIMPI_Comm comm);
 
 #endif // MIMPI_COMMON_H
\ No newline at end of file
@@ -2,15 +2,30 @@
  * This file is for implementation of mimpirun program.
  * */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
 #include "mimpi_common.h"
 #include "channel.h"
 
 #define DESC_SHIFT 30
+#define SHARED_DESC (DESC_SHIFT - 1)
+#define SHARED_MIN_BYTES (2 * 64 + 512)    // control structure of the segment and one frame of data
+
+#define KEEP_READ 1
+#define KEEP_WRITE 2
+
+extern char **environ;
 
 void findNodeRelations(const int* worldRank, const int* worldSize, int* parentNode, int* leftChild, int* rightChild) {
     if (*worldRank == 0) {
@@ -54,30 +69,283 @@ void setWorldRank(int worldRank) {
     }
 }
 
+void setLaunchTime() {
+    struct timespec now;
+    char buffer[64];
+    ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &now));
+    snprintf(buffer, sizeof(buffer), "%ld", now.tv_sec * 1000000L + now.tv_nsec / 1000L);
+    if (setenv("MIMPI_ENV_LAUNCH_USEC", buffer, 1) != 0) {
+        fprintf(stderr, "Setting env variable MIMPI_ENV_LAUNCH_USEC failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Index of the pair of processes among all ordered pairs (sender, receiver):
+int pairIndex(int sender, int receiver, int worldSize) {
+    return sender * (worldSize - 1) + (receiver < sender ? receiver : receiver - 1);
+}
+
+// Finds pipe ends (KEEP_READ, KEEP_WRITE) that the process uses, the others are closed when it is spawned:
+void findKeptEnds(int worldRank, int worldSize, int stripes, char* keptEnds) {
+
+    // Find node relations:
+    int parentNode = -1;
+    int leftChild = -1;
+    int rightChild = -1;
+    findNodeRelations(&worldRank, &worldSize, &parentNode, &leftChild, &rightChild);
+
+    int k = 0;
+    for(int j = 0; j < worldSize*(worldSize-1) + 2*(worldSize-1); ++j) {
+        if(k != j && j%(worldSize-1) == 0 && k < worldSize) {
+            k++;
+        }
+
+        // Descriptors for point-to-point messages:
+
+        if(worldRank*(worldSize-1) <= j && j < (worldRank+1)*(worldSize-1)) { //czytające końce p-p:
+            keptEnds[j] = KEEP_READ;
+        } else if(j < worldRank*(worldSize-1) && j == k*(worldSize-1)+worldRank-1) { //piszące końce p-p:
+            keptEnds[j] = KEEP_WRITE;
+        } else if((worldRank+1)*(worldSize-1) <= j && j < worldSize*(worldSize-1) && j == k*(worldSize-1)+worldRank) { //piszące końce p-p:
+            keptEnds[j] = KEEP_WRITE;
+
+            // Descriptors for group messages:
+
+        } else if(j == worldSize*(worldSize-1) + 2*(worldRank-1) && parentNode != -1) { //czytający koniec group (lewy pipe do parentNode):
+            keptEnds[j] = KEEP_READ;
+        } else if(j == worldSize*(worldSize-1) + 2*(worldRank-1) + 1 && parentNode != -1) { //piszący koniec group (prawy pipe do parentNode):
+            keptEnds[j] = KEEP_WRITE;
+        } else if(j == worldSize*(worldSize-1) + 4*worldRank && leftChild != -1) { //piszący koniec group (lewy pipe do leftChild):
+            keptEnds[j] = KEEP_WRITE;
+        } else if(j == worldSize*(worldSize-1) + 4*worldRank + 1 && leftChild != -1) { //czytający koniec group (prawy pipe do leftChild):
+            keptEnds[j] = KEEP_READ;
+        } else if(j == worldSize*(worldSize-1) + 4*worldRank+2 && rightChild != -1) { //piszący koniec group (lewy pipe do rightChild):
+            keptEnds[j] = KEEP_WRITE;
+        } else if(j == worldSize*(worldSize-1) + 4*worldRank+2 + 1 && rightChild != -1) { //czytający koniec group (prawy pipe do rightChild):
+            keptEnds[j] = KEEP_READ;
+
+            // Other descriptors:
+
+        } else {
+            keptEnds[j] = 0;
+        }
+    }
+
+    // Extra channels of striping, stripes-1 for every pair after the channels above:
+    int first = worldSize*(worldSize-1) + 2*(worldSize-1);
+    for(int sender = 0; sender < worldSize; ++sender) {
+        for(int receiver = 0; receiver < worldSize; ++receiver) {
+            if (sender == receiver) {
+                continue;
+            }
+            for(int i = 0; i < stripes - 1; ++i) {
+                int j = first + pairIndex(sender, receiver, worldSize) * (stripes - 1) + i;
+                keptEnds[j] = (sender == worldRank ? KEEP_WRITE : 0) | (receiver == worldRank ? KEEP_READ : 0);
+            }
+        }
+    }
+}
+
+// Reads the biggest pipe capacity that can be set without privileges, 0 if it is unknown.
+int readPipeMaxSize() {
+    int maxSize = 0;
+    FILE* file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%d", &maxSize) != 1) {
+            maxSize = 0;
+        }
+        fclose(file);
+    }
+    return maxSize;
+}
+
+// Sets capacity of the pipe (within the system limit), returns the actual capacity.
+int resizePipe(int desc, int requested, int maxSize) {
+    if (requested > 0) {
+        if (maxSize > 0 && requested > maxSize) {
+            requested = maxSize;
+        }
+        if (fcntl(desc, F_SETPIPE_SZ, requested) == -1) {
+            perror("Setting pipe size failed");
+        }
+    }
+    return fcntl(desc, F_GETPIPE_SZ);
+}
+
+void printUsage(const char* name) {
+    fprintf(stderr, "Usage: %s [--pipe-size <bytes>] [--group-pipe-size <bytes>] [--kill-grace <ms>] [--shm-bytes <bytes>] [--stripes <k>] <n> <prog> [args...]\n", name);
+}
+
+int findRank(const pid_t* pids, int worldSize, pid_t pid) {
+    for(int i = 0; i < worldSize; ++i) {
+        if (pids[i] == pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Exit status of mimpirun for a failed process (like a shell: 128 + signal number for a killed one):
+int reportFailure(int worldRank, int status) {
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "mimpirun: rank %d killed by signal %d (%s)\n",
+                worldRank, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        return 128 + WTERMSIG(status);
+    }
+    fprintf(stderr, "mimpirun: rank %d exited with status %d\n", worldRank, WEXITSTATUS(status));
+    return WEXITSTATUS(status);
+}
+
+// Waits for all processes, when one of them fails the others get killGrace milliseconds to finish.
+int waitForRanks(pid_t* pids, int worldSize, int killGrace) {
+    int running = worldSize;
+    int failedRank = -1;
+    int exitStatus = 0;
+    struct timespec failureTime;
+
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, failedRank == -1 ? 0 : WNOHANG);
+        ASSERT_SYS_OK(pid);
+
+        if (pid == 0) {
+
+            // Grace period has passed, the rest of the job is hung or waits for the failed process:
+            struct timespec now;
+            ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &now));
+            long waited = (now.tv_sec - failureTime.tv_sec) * 1000L + (now.tv_nsec - failureTime.tv_nsec) / 1000000L;
+            if (waited >= killGrace) {
+                for(int i = 0; i < worldSize; ++i) {
+                    if (pids[i] != -1) {
+                        kill(pids[i], SIGKILL);
+                    }
+                }
+                killGrace = -1;
+                ASSERT_SYS_OK(pid = waitpid(-1, &status, 0));
+            } else {
+                struct timespec pause = {0, 1000000L};
+                nanosleep(&pause, NULL);
+                continue;
+            }
+        }
+
+        int worldRank = findRank(pids, worldSize, pid);
+        if (worldRank == -1) {
+            continue;
+        }
+        pids[worldRank] = -1;
+        running--;
+
+        // Processes killed by us are not reported:
+        bool failed = WIFSIGNALED(status) || WEXITSTATUS(status) != 0;
+        if (failed && killGrace != -1) {
+            int rankStatus = reportFailure(worldRank, status);
+            if (failedRank == -1) {
+                failedRank = worldRank;
+                exitStatus = rankStatus;
+                ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &failureTime));
+                if (running > 0) {
+                    fprintf(stderr, "mimpirun: stopping remaining %d ranks in %d ms\n", running, killGrace);
+                }
+            }
+        }
+    }
+
+    if (failedRank != -1) {
+        fprintf(stderr, "mimpirun: job failed, first failing rank %d\n", failedRank);
+    }
+    return exitStatus;
+}
 
 int main(int argc, char *argv[]) {
 
+    // Pipe capacities, options override environment variables (0 - kernel default):
+    int pipeSize = getEnvInt("MIMPI_PIPE_SIZE", 0);
+    int groupPipeSize = getEnvInt("MIMPI_GROUP_PIPE_SIZE", 0);
+
+    // Time (in milliseconds) that other processes get to finish after one of them fails:
+    int killGrace = getEnvInt("MIMPI_KILL_GRACE_MSEC", 1000);
+
+    // Size of the segment for shared-memory collectives (0 - collectives go through pipes):
+    int sharedBytes = getEnvInt("MIMPI_SHM_BYTES", 0);
+
+    // Channels for every pair of processes, large messages are striped across them (1 - no striping):
+    int stripes = getEnvInt("MIMPI_STRIPES", 1);
+
+    // Options:
+    int first = 1;
+    while (first + 1 < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strcmp(argv[first], "--pipe-size") == 0) {
+            pipeSize = (int)strtol(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "--group-pipe-size") == 0) {
+            groupPipeSize = (int)strtol(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "--kill-grace") == 0) {
+            killGrace = (int)strtol(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "--shm-bytes") == 0) {
+            sharedBytes = (int)strtol(argv[first + 1], NULL, 10);
+        } else if (strcmp(argv[first], "--stripes") == 0) {
+            stripes = (int)strtol(argv[first + 1], NULL, 10);
+        } else {
+            printUsage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        first += 2;
+    }
+
     // Check the number of command line arguments:
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <n> <prog> [args...]\n", argv[0]);
+    if (argc - first < 2) {
+        printUsage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    argc -= first - 1;
+    argv += first - 1;
+
+    // Segment has to fit its control structure and one frame:
+    if (sharedBytes != 0 && sharedBytes < SHARED_MIN_BYTES) {
+        fprintf(stderr, "Shared segment needs at least %d bytes, got %d\n", SHARED_MIN_BYTES, sharedBytes);
         exit(EXIT_FAILURE);
     }
 
     int worldSize = (int)strtol(argv[1], NULL, 10);
     char *prog = argv[2];
+    stripes = stripes < 1 ? 1 : stripes;
 
     // Set world size:
     setWorldSize(worldSize);
 
     // Define pipes for communication between child processes:
-    int pipes[worldSize*(worldSize-1) + 2*(worldSize-1)][2]; //MAX 15*16*2 = 480pipes => 480*2 = 960desc => 960+20 = 980 occupied desc
+    int pipeCount = worldSize*(worldSize-1) + 2*(worldSize-1) + worldSize*(worldSize-1)*(stripes-1);
+    int (*pipes)[2] = malloc(pipeCount * sizeof(*pipes));
+    if (pipes == NULL) {
+        perror("Memory allocation error in pipes");
+        exit(EXIT_FAILURE);
+    }
+
+    // Extra channels may need more descriptors than the default limit:
+    struct rlimit limit;
+    ASSERT_SYS_OK(getrlimit(RLIMIT_NOFILE, &limit));
+    rlim_t needed = DESC_SHIFT + 2 * (rlim_t)pipeCount + 1;
+    if (limit.rlim_cur < needed && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = needed < limit.rlim_max ? needed : limit.rlim_max;
+        ASSERT_SYS_OK(setrlimit(RLIMIT_NOFILE, &limit));
+    }
 
     // Establish pipes:
+    int pipeMaxSize = readPipeMaxSize();
+    int actualPipeSize = 0;
+    int actualGroupPipeSize = 0;
     int firstFree = DESC_SHIFT;
-    for(int i = 0; i < worldSize*(worldSize-1) + 2*(worldSize-1); ++i) {
+    for(int i = 0; i < pipeCount; ++i) {
 
         ASSERT_SYS_OK(channel(pipes[i]));
 
+        // Capacity of point-to-point (or striping) or group pipe:
+        if (i < worldSize*(worldSize-1) || i >= worldSize*(worldSize-1) + 2*(worldSize-1)) {
+            actualPipeSize = resizePipe(pipes[i][0], pipeSize, pipeMaxSize);
+        } else {
+            actualGroupPipeSize = resizePipe(pipes[i][0], groupPipeSize, pipeMaxSize);
+        }
+
         ASSERT_SYS_OK(dup2(pipes[i][0], firstFree));
         ASSERT_SYS_OK(dup2(pipes[i][1], firstFree + 1));
 
@@ -90,83 +358,111 @@ int main(int argc, char *argv[]) {
         firstFree += 2;
     }
 
-    // Run worldSize copies of the prog program:
+    // Shared segment, mapped by every process at SHARED_DESC:
+    if (sharedBytes > 0) {
+        int sharedDesc = memfd_create("mimpi", 0);
+        ASSERT_SYS_OK(sharedDesc);
+        ASSERT_SYS_OK(ftruncate(sharedDesc, sharedBytes));
+        ASSERT_SYS_OK(dup2(sharedDesc, SHARED_DESC));
+        ASSERT_SYS_OK(close(sharedDesc));
+
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%d", sharedBytes);
+        if (setenv("MIMPI_ENV_SHM_BYTES", buffer, 1) != 0) {
+            fprintf(stderr, "Setting env variable MIMPI_ENV_SHM_BYTES failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (stripes > 1) {
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%d", stripes);
+        if (setenv("MIMPI_ENV_STRIPES", buffer, 1) != 0) {
+            fprintf(stderr, "Setting env variable MIMPI_ENV_STRIPES failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Report capacities if they were configured:
+    if (pipeSize > 0 || groupPipeSize > 0) {
+        fprintf(stderr, "mimpirun: point-to-point pipes: configured %d, actual %d bytes\n", pipeSize, actualPipeSize);
+        fprintf(stderr, "mimpirun: group pipes: configured %d, actual %d bytes\n", groupPipeSize, actualGroupPipeSize);
+        fprintf(stderr, "mimpirun: system limit %d bytes\n", pipeMaxSize);
+    }
+
+    // Descriptors of every process are known before anything is spawned:
+    char (*keptEnds)[pipeCount] = malloc(worldSize * sizeof(*keptEnds));
+    if (keptEnds == NULL) {
+        perror("Memory allocation error in keptEnds");
+        exit(EXIT_FAILURE);
+    }
     for(int worldRank = 0; worldRank < worldSize; ++worldRank) {
+        findKeptEnds(worldRank, worldSize, stripes, keptEnds[worldRank]);
+    }
 
-        // Set world rank:
-        setWorldRank(worldRank);
+    // Construct the argument list for the program:
+    char *args[argc - 1];
+    args[0] = prog;
+    for(int j = 1; j < argc - 1; ++j) {
+        args[j] = argv[j + 2];
+    }
 
-        pid_t pid = fork();
-        ASSERT_SYS_OK(pid);
-        if(!pid) {
-
-            // Find node relations:
-            int parentNode = -1;
-            int leftChild = -1;
-            int rightChild = -1;
-            findNodeRelations(&worldRank, &worldSize, &parentNode, &leftChild, &rightChild);
-
-            // Close unused descriptors:
-            int k = 0;
-            for(int j = 0; j < worldSize*(worldSize-1) + 2*(worldSize-1); ++j) {
-                if(k != j && j%(worldSize-1) == 0 && k < worldSize) {
-                    k++;
-                }
+    pid_t pids[worldSize];
 
-                // Descriptors for point-to-point messages:
-
-                if(worldRank*(worldSize-1) <= j && j < (worldRank+1)*(worldSize-1)) { //czytające końce p-p -> zamykamy końce do pisania:
-                    ASSERT_SYS_OK(close(pipes[j][1]));
-                } else if(j < worldRank*(worldSize-1) && j == k*(worldSize-1)+worldRank-1) { //piszące końce p-p -> zamykamy końce do czytania:
-                    ASSERT_SYS_OK(close(pipes[j][0]));
-                } else if((worldRank+1)*(worldSize-1) <= j && j < worldSize*(worldSize-1) && j == k*(worldSize-1)+worldRank) { //piszące końce p-p -> zamykamy końce do czytania:
-                    ASSERT_SYS_OK(close(pipes[j][0]));
-
-                    // Descriptors for group messages:
-
-                } else if(j == worldSize*(worldSize-1) + 2*(worldRank-1) && parentNode != -1) { //czytający koniec group (lewy pipe do parentNode) -> zamykamy koniec do pisania:
-                    ASSERT_SYS_OK(close(pipes[j][1]));
-                } else if(j == worldSize*(worldSize-1) + 2*(worldRank-1) + 1 && parentNode != -1) { //piszący koniec group (prawy pipe do parentNode) -> zamykamy koniec do czytania:
-                    ASSERT_SYS_OK(close(pipes[j][0]));
-                } else if(j == worldSize*(worldSize-1) + 4*worldRank && leftChild != -1) { //piszący koniec group (lewy pipe do leftChild) -> zamykamy koniec do czytania:
-                    ASSERT_SYS_OK(close(pipes[j][0]));
-                } else if(j == worldSize*(worldSize-1) + 4*worldRank + 1 && leftChild != -1) { //czytający koniec group (prawy pipe do leftChild) -> zamykamy koniec do pisania:
-                    ASSERT_SYS_OK(close(pipes[j][1]));
-                } else if(j == worldSize*(worldSize-1) + 4*worldRank+2 && rightChild != -1) { //piszący koniec group (lewy pipe do rightChild) -> zamykamy koniec do czytania:
-                    ASSERT_SYS_OK(close(pipes[j][0]));
-                } else if(j == worldSize*(worldSize-1) + 4*worldRank+2 + 1 && rightChild != -1) { //czytający koniec group (prawy pipe do rightChild) -> zamykamy koniec do pisania:
-                    ASSERT_SYS_OK(close(pipes[j][1]));
-
-                    // Other descriptors:
-
-                } else {
-                    ASSERT_SYS_OK(close(pipes[j][1]));
-                    ASSERT_SYS_OK(close(pipes[j][0]));
-                }
-            }
+    // Run worldSize copies of the prog program (posix_spawn does not copy our memory like fork):
+    int printTimes = getEnvInt("MIMPI_STATS", 0) == 1;
+    struct timespec launchStart;
+    ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &launchStart));
+    for(int worldRank = 0; worldRank < worldSize; ++worldRank) {
+        struct timespec spawnStart;
+        ASSERT_SYS_OK(clock_gettime(CLOCK_MONOTONIC, &spawnStart));
 
-            // Construct the argument list for execvp:
-            char *args[argc - 1];
-            args[0] = prog;
-            for(int j = 1; j < argc - 1; ++j) {
-                args[j] = argv[j + 2];
+        // Set world rank and time of the launch:
+        setWorldRank(worldRank);
+        setLaunchTime();
+
+        // Close unused descriptors in the child:
+        posix_spawn_file_actions_t actions;
+        ASSERT_ZERO(posix_spawn_file_actions_init(&actions));
+        for(int j = 0; j < pipeCount; ++j) {
+            if (!(keptEnds[worldRank][j] & KEEP_READ)) {
+                ASSERT_ZERO(posix_spawn_file_actions_addclose(&actions, pipes[j][0]));
+            }
+            if (!(keptEnds[worldRank][j] & KEEP_WRITE)) {
+                ASSERT_ZERO(posix_spawn_file_actions_addclose(&actions, pipes[j][1]));
             }
+        }
 
-            ASSERT_SYS_OK(execvp(prog, args));
+        ASSERT_ZERO(posix_spawnp(&pids[worldRank], prog, &actions, NULL, args, environ));
+        ASSERT_ZERO(posix_spawn_file_actions_destroy(&actions));
+
+        if (printTimes) {
+            fprintf(stderr, "mimpirun: rank %d spawned in %ld us\n", worldRank, elapsedMicroseconds(&spawnStart));
         }
     }
+    if (printTimes) {
+        fprintf(stderr, "mimpirun: %d ranks spawned in %ld us\n", worldSize, elapsedMicroseconds(&launchStart));
+    }
+    free(keptEnds);
 
     // Close unused descriptors:
-    for(int i = 0; i < worldSize*(worldSize-1) + 2*(worldSize-1); ++i){
+    for(int i = 0; i < pipeCount; ++i){
         ASSERT_SYS_OK(close(pipes[i][0]));
         ASSERT_SYS_OK(close(pipes[i][1]));
     }
+    free(pipes);
 
-    // Wait for all created processes to finish:
-    for(int i = 0; i < worldSize; ++i) {
-        ASSERT_SYS_OK(wait(NULL));
+    if (sharedBytes > 0) {
+        ASSERT_SYS_OK(close(SHARED_DESC));
+        unsetenv("MIMPI_ENV_SHM_BYTES");
+    }
+    if (stripes > 1) {
+        unsetenv("MIMPI_ENV_STRIPES");
     }
 
+    // Wait for all created processes to finish:
+    int exitStatus = waitForRanks(pids, worldSize, killGrace < 0 ? 0 : killGrace);
+
     // Unset environment variables:
     if (unsetenv("MIMPI_ENV_WORLD_SIZE") != 0) {
         fprintf(stderr, "Unsetting env variable MIMPI_ENV_WORLD_SIZE failed\n");
@@ -176,6 +472,10 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Unsetting env variable MIMPI_ENV_WORLD_RANK failed\n");
         exit(EXIT_FAILURE);
     }
+    if (unsetenv("MIMPI_ENV_LAUNCH_USEC") != 0) {
+        fprintf(stderr, "Unsetting env variable MIMPI_ENV_LAUNCH_USEC failed\n");
+        exit(EXIT_FAILURE);
+    }
 
-    return 0;
+    return exitStatus;
 }
\ No newline at end of file